@@ -122,6 +122,36 @@ rufl_code rufl_split(const char *font_family, rufl_style font_style,
 		size_t *char_offset, int *actual_x);
 
 
+/** A line of text found by rufl_break_lines(). */
+struct rufl_line {
+	/** Byte offset in the string of the start of the next line. */
+	size_t offset;
+	/** Width of the line, excluding any trailing spaces. */
+	int width;
+};
+
+
+/**
+ * Break a paragraph of Unicode text into lines.
+ *
+ * Lines are broken after runs of spaces. Line i may be at most
+ * widths[i] wide, or widths[widths_count - 1] for lines beyond the
+ * end of widths. A word which is too wide for an empty line is placed on
+ * a line by itself.
+ *
+ * At most max_lines lines are found. If the text needs more lines, the
+ * rest of the text is not broken and rufl_OK is still returned: the caller
+ * must check whether the offset of the last line found is less than length.
+ */
+
+rufl_code rufl_break_lines(const char *font_family, rufl_style font_style,
+		unsigned int font_size,
+		const char *string, size_t length,
+		const int *widths, size_t widths_count,
+		struct rufl_line *lines, size_t max_lines,
+		size_t *line_count);
+
+
 /** Type of callback function for rufl_paint_callback(). */
 typedef void (*rufl_callback_t)(void *context,
 		const char *font_name, unsigned int font_size,
@@ -129,6 +159,61 @@ typedef void (*rufl_callback_t)(void *context,
 		int x, int y);
 
 
+/**
+ * Render Unicode text with extra space between letters and words.
+ *
+ * letter_spacing is added after every character, and word_spacing after
+ * every space character as well, as for CSS letter-spacing and
+ * word-spacing. Both are in OS units and may be negative. The spacing is
+ * applied by the Font Manager, so spaced text is painted and measured as
+ * quickly as unspaced text.
+ */
+
+rufl_code rufl_paint_spaced(const char *font_family, rufl_style font_style,
+		unsigned int font_size,
+		const char *string, size_t length,
+		int x, int y, unsigned int flags,
+		int letter_spacing, int word_spacing);
+
+
+/**
+ * Measure the width of Unicode text with extra space between letters and
+ * words.
+ */
+
+rufl_code rufl_width_spaced(const char *font_family, rufl_style font_style,
+		unsigned int font_size,
+		const char *string, size_t length,
+		int letter_spacing, int word_spacing,
+		int *width);
+
+
+/**
+ * Find where in a string a x coordinate falls, with extra space between
+ * letters and words.
+ */
+
+rufl_code rufl_x_to_offset_spaced(const char *font_family,
+		rufl_style font_style, unsigned int font_size,
+		const char *string, size_t length,
+		int letter_spacing, int word_spacing,
+		int click_x,
+		size_t *char_offset, int *actual_x);
+
+
+/**
+ * Find the prefix of a string that will fit in a specified width, with
+ * extra space between letters and words.
+ */
+
+rufl_code rufl_split_spaced(const char *font_family, rufl_style font_style,
+		unsigned int font_size,
+		const char *string, size_t length,
+		int letter_spacing, int word_spacing,
+		int width,
+		size_t *char_offset, int *actual_x);
+
+
 /**
  * Render text, but call a callback instead of each call to Font_Paint.
  */
@@ -140,6 +225,211 @@ rufl_code rufl_paint_callback(const char *font_family, rufl_style font_style,
 		rufl_callback_t callback, void *context);
 
 
+/** Identity of a Font Manager font and encoding, as passed to
+ * rufl_callback_id_t. Ids are valid until rufl_quit() is called. */
+typedef uint32_t rufl_font_id;
+
+/** Type of callback function for rufl_paint_callback_id(). */
+typedef void (*rufl_callback_id_t)(void *context,
+		rufl_font_id font_id, unsigned int font_size,
+		const uint8_t *s8, const uint32_t *s32, unsigned int n,
+		int x, int y);
+
+
+/**
+ * Render text, but call a callback instead of each call to Font_Paint,
+ * identifying fonts by id rather than by name.
+ */
+
+rufl_code rufl_paint_callback_id(const char *font_family,
+		rufl_style font_style, unsigned int font_size,
+		const char *string, size_t length,
+		int x, int y,
+		rufl_callback_id_t callback, void *context);
+
+
+/**
+ * Find the Font Manager name of a font id.
+ *
+ * The name remains valid until rufl_quit() is called.
+ */
+
+const char *rufl_font_id_name(rufl_font_id font_id);
+
+
+/** Unicode text which has been split into runs of characters from a single
+ * font, for painting and measuring repeatedly. A layout remains valid until
+ * rufl_quit() is called. */
+typedef struct rufl_layout rufl_layout;
+
+
+/**
+ * Split Unicode text into runs of characters from a single font.
+ *
+ * The layout must be freed using rufl_layout_destroy().
+ */
+
+rufl_code rufl_layout_create(const char *font_family, rufl_style font_style,
+		unsigned int font_size,
+		const char *string, size_t length,
+		rufl_layout **layout);
+
+
+/**
+ * Render laid out text.
+ */
+
+rufl_code rufl_layout_paint(const rufl_layout *layout,
+		int x, int y, unsigned int flags);
+
+
+/**
+ * Measure the width of laid out text.
+ */
+
+rufl_code rufl_layout_width(const rufl_layout *layout, int *width);
+
+
+/**
+ * Find where in laid out text a x coordinate falls.
+ */
+
+rufl_code rufl_layout_x_to_offset(const rufl_layout *layout,
+		int click_x,
+		size_t *char_offset, int *actual_x);
+
+
+/**
+ * Find the prefix of laid out text that will fit in a specified width.
+ */
+
+rufl_code rufl_layout_split(const rufl_layout *layout,
+		int width,
+		size_t *char_offset, int *actual_x);
+
+
+/**
+ * Render laid out text, but call a callback instead of each call to
+ * Font_Paint.
+ */
+
+rufl_code rufl_layout_paint_callback(const rufl_layout *layout,
+		int x, int y,
+		rufl_callback_t callback, void *context);
+
+
+/**
+ * Free a layout.
+ */
+
+void rufl_layout_destroy(rufl_layout *layout);
+
+
+/** A font family and style, resolved to a font once so that it may be used
+ * for many calls. A face remains valid until rufl_quit() is called. */
+typedef struct rufl_face rufl_face;
+
+
+/**
+ * Resolve a font family and style to a face.
+ *
+ * The face must be freed using rufl_face_destroy().
+ */
+
+rufl_code rufl_face_resolve(const char *font_family, rufl_style font_style,
+		rufl_face **face);
+
+
+/**
+ * Render Unicode text in a face.
+ */
+
+rufl_code rufl_face_paint(const rufl_face *face, unsigned int font_size,
+		const char *string, size_t length,
+		int x, int y, unsigned int flags);
+
+
+/**
+ * Measure the width of Unicode text in a face.
+ */
+
+rufl_code rufl_face_width(const rufl_face *face, unsigned int font_size,
+		const char *string, size_t length,
+		int *width);
+
+
+/**
+ * Find where in a string a x coordinate falls, for text in a face.
+ */
+
+rufl_code rufl_face_x_to_offset(const rufl_face *face,
+		unsigned int font_size,
+		const char *string, size_t length,
+		int click_x,
+		size_t *char_offset, int *actual_x);
+
+
+/**
+ * Find the prefix of a string that will fit in a specified width, for text
+ * in a face.
+ */
+
+rufl_code rufl_face_split(const rufl_face *face, unsigned int font_size,
+		const char *string, size_t length,
+		int width,
+		size_t *char_offset, int *actual_x);
+
+
+/**
+ * Render text in a face, but call a callback instead of each call to
+ * Font_Paint.
+ */
+
+rufl_code rufl_face_paint_callback(const rufl_face *face,
+		unsigned int font_size,
+		const char *string, size_t length,
+		int x, int y,
+		rufl_callback_t callback, void *context);
+
+
+/**
+ * Read the metrics of a face (sized for a 1pt font).
+ */
+
+rufl_code rufl_face_font_metrics(const rufl_face *face,
+		os_box *bbox, int32_t *xkern, int32_t *ykern, int32_t *italic,
+		int32_t *ascent, int32_t *descent,
+		int32_t *xheight, int32_t *cap_height,
+		int8_t *uline_position, uint8_t *uline_thickness);
+
+
+/**
+ * Read the metrics of a glyph in a face.
+ */
+
+rufl_code rufl_face_glyph_metrics(const rufl_face *face,
+		unsigned int font_size,
+		const char *string, size_t length,
+		int32_t *x_bearing, int32_t *y_bearing,
+		int32_t *width, int32_t *height,
+		int32_t *x_advance, int32_t *y_advance);
+
+
+/**
+ * Determine the maximum bounding box of a face.
+ */
+
+rufl_code rufl_face_font_bbox(const rufl_face *face, unsigned int font_size,
+		os_box *bbox);
+
+
+/**
+ * Free a face.
+ */
+
+void rufl_face_destroy(rufl_face *face);
+
+
 /**
  * Decompose a glyph to a path.
  */
@@ -173,6 +463,63 @@ rufl_code rufl_glyph_metrics(const char *font_family,
 		int32_t *x_advance, int32_t *y_advance);
 
 
+/** Largest number of font families used from a list of families. */
+#define rufl_FAMILIES_MAX 8
+
+/**
+ * Render Unicode text in the first of a list of font families which has
+ * each character.
+ *
+ * Each character is taken from the first family in font_families which
+ * has it, as for a CSS font-family list, or else from the font given by
+ * the substitution table. Families which are not available are skipped,
+ * and only the first rufl_FAMILIES_MAX are used.
+ */
+
+rufl_code rufl_paint_families(const char *const *font_families,
+		unsigned int families, rufl_style font_style,
+		unsigned int font_size,
+		const char *string, size_t length,
+		int x, int y, unsigned int flags);
+
+
+/**
+ * Measure the width of Unicode text in a list of font families.
+ */
+
+rufl_code rufl_width_families(const char *const *font_families,
+		unsigned int families, rufl_style font_style,
+		unsigned int font_size,
+		const char *string, size_t length,
+		int *width);
+
+
+/**
+ * Find where in a string a x coordinate falls, for text in a list of font
+ * families.
+ */
+
+rufl_code rufl_x_to_offset_families(const char *const *font_families,
+		unsigned int families, rufl_style font_style,
+		unsigned int font_size,
+		const char *string, size_t length,
+		int click_x,
+		size_t *char_offset, int *actual_x);
+
+
+/**
+ * Find the prefix of a string that will fit in a specified width, for text
+ * in a list of font families.
+ */
+
+rufl_code rufl_split_families(const char *const *font_families,
+		unsigned int families, rufl_style font_style,
+		unsigned int font_size,
+		const char *string, size_t length,
+		int width,
+		size_t *char_offset, int *actual_x);
+
+
 /**
  * Determine the maximum bounding box of a font.
  */
@@ -181,6 +528,64 @@ rufl_code rufl_font_bbox(const char *font_family, rufl_style font_style,
 		unsigned int font_size, os_box *bbox);
 
 
+/** Counters of work done by the library. */
+struct rufl_stats {
+	/** Font handles found in the handle cache. */
+	unsigned long handle_cache_hits;
+	/** Font handles not in the handle cache. */
+	unsigned long handle_cache_misses;
+	/** Font handles lost to make space in the handle cache. */
+	unsigned long handle_cache_evictions;
+	/** Font_FindFont calls which failed because the Font Manager had no
+	 * free handles, and were retried after losing a cached handle. */
+	unsigned long handle_exhaustions;
+	/** Font handles for a reference size used in place of a handle for
+	 * the requested size, see rufl_set_size_sharing(). */
+	unsigned long shared_size_lookups;
+	/** Glyph advances found in the advance cache. */
+	unsigned long advance_cache_hits;
+	/** Glyph advances not in the advance cache. */
+	unsigned long advance_cache_misses;
+	/** Characters whose font was found in the resolution cache. */
+	unsigned long resolve_cache_hits;
+	/** Characters whose font was not in the resolution cache. */
+	unsigned long resolve_cache_misses;
+	/** Characters given the font of a preceding substituted character,
+	 * as part of its range, without being resolved. */
+	unsigned long resolve_run_hits;
+	/** Font Manager SWIs issued. */
+	unsigned long font_paint;
+	unsigned long font_scan_string;
+	unsigned long font_find_font;
+	unsigned long font_enumerate_characters;
+	/** Runs of characters from a single font processed. */
+	unsigned long spans;
+	/** Code points found in the requested font. */
+	unsigned long code_points_font;
+	/** Code points found in another font via the substitution table. */
+	unsigned long code_points_substituted;
+	/** Code points not found in any font. */
+	unsigned long code_points_not_available;
+};
+
+
+/**
+ * Read the library's performance counters.
+ *
+ * The counters accumulate from startup, or the last call to
+ * rufl_reset_stats(), and are not reset by rufl_init() or rufl_quit().
+ */
+
+void rufl_get_stats(struct rufl_stats *stats);
+
+
+/**
+ * Reset the library's performance counters to zero.
+ */
+
+void rufl_reset_stats(void);
+
+
 /**
  * Dump the internal library state to stdout.
  */
@@ -189,14 +594,161 @@ void rufl_dump_state(bool verbose);
 
 
 /**
- * Clear the internal font handle cache.
+ * Clear the internal font handle cache and glyph advances of the current
+ * output context. Other output contexts are not affected.
  *
- * Call this function on mode changes or output redirection changes.
+ * Call this function on mode changes, or when output is redirected without
+ * changing output context.
  */
 
 void rufl_invalidate_cache(void);
 
 
+/** Output contexts. Each keeps its own font handles and resolution, so
+ * output may be redirected and restored without losing font handles. */
+typedef enum {
+	rufl_CONTEXT_SCREEN,
+	rufl_CONTEXT_PRINTER,
+	rufl_CONTEXT_SPRITE
+} rufl_context;
+
+
+/**
+ * Select the output context that following calls render to.
+ *
+ * The initial context is rufl_CONTEXT_SCREEN.
+ */
+
+void rufl_set_output_context(rufl_context context);
+
+
+/**
+ * Set the resolution that fonts are opened at in an output context.
+ *
+ * Resolutions are in dots per inch, or 0 for the current mode's.
+ */
+
+void rufl_set_output_context_resolution(rufl_context context,
+		int xres, int yres);
+
+
+/** Largest number of font handles that the library may keep open. */
+#define rufl_HANDLE_CACHE_SIZE_MAX 255
+
+/**
+ * Set the maximum number of font handles that the library keeps open.
+ *
+ * The default is 10. A larger cache avoids repeated Font_FindFont calls
+ * when many fonts and sizes are in use. May be called before rufl_init().
+ *
+ * If the Font Manager runs out of font handles, cached handles are lost
+ * until a font can be found, and fewer are kept until the shortage has
+ * passed.
+ */
+
+rufl_code rufl_set_handle_cache_size(unsigned int size);
+
+
+/**
+ * Share font handles between sizes.
+ *
+ * Fonts are opened at a series of reference sizes, starting at min_size,
+ * each tolerance percent larger than the previous. Other sizes of at least
+ * min_size are painted and measured with the handle of the largest
+ * reference size below them, scaled by a transform. Smaller sizes, where
+ * hinting matters most, always use a handle of the exact size.
+ *
+ * Only text painting and measurement on the Unicode Font Manager is
+ * affected. Sharing is off by default, and min_size 0 turns it off again.
+ * Changing the setting empties the cache of glyph advances, which were
+ * measured under the old setting.
+ */
+
+void rufl_set_size_sharing(unsigned int min_size, unsigned int tolerance);
+
+
+/** Policies for choosing the font which provides a character missing from
+ * the requested font. */
+typedef enum {
+	/** The first font, in order of identifier, with the character. */
+	rufl_SUBSTITUTION_FIRST_FONT,
+	/** Prefer the fonts which provide most other characters of the same
+	 * block of 256 characters. Neighbouring characters, which are
+	 * usually of the same script, come from fewer fonts, so text is
+	 * processed in longer spans. */
+	rufl_SUBSTITUTION_LOCALITY
+} rufl_substitution_policy;
+
+
+/**
+ * Set the policy for choosing substitute fonts.
+ *
+ * The default is rufl_SUBSTITUTION_FIRST_FONT. The policy takes effect
+ * from the next rufl_init().
+ */
+
+void rufl_set_substitution_policy(rufl_substitution_policy policy);
+
+
+/**
+ * Make a name stand for a font family, such as a CSS generic family.
+ *
+ * For example, after rufl_set_family_alias("sans-serif", "Homerton"),
+ * "sans-serif" may be passed wherever a font family is accepted. Aliases
+ * are resolved by rufl_init(), or immediately if it has already been
+ * called, and are found as quickly as real families. A real family of the
+ * same name takes precedence, and an alias for a family which is not
+ * available is ignored. Aliases are kept across rufl_quit(). Passing 0 as
+ * font_family removes an alias.
+ */
+
+rufl_code rufl_set_family_alias(const char *alias, const char *font_family);
+
+
+/** A font family, style and size, for rufl_font_prefetch() and
+ * rufl_font_pin(). */
+struct rufl_sized_font {
+	const char *font_family;
+	rufl_style font_style;
+	unsigned int font_size;
+};
+
+
+/**
+ * Open the font handles for a list of fonts ahead of use.
+ *
+ * This includes the handle used to render characters which are not
+ * available in any font. Handles for substituted characters are opened
+ * when first needed.
+ */
+
+rufl_code rufl_font_prefetch(const struct rufl_sized_font *fonts,
+		size_t count);
+
+
+/**
+ * Open the font handles for a list of fonts, and keep them open until
+ * rufl_font_unpin() is called for the same fonts.
+ *
+ * Pins are counted. Pinned handles may take the handle cache over the size
+ * set by rufl_set_handle_cache_size(). rufl_invalidate_cache() loses pinned
+ * handles too, and their pins.
+ *
+ * When sizes are shared, the handles pinned are those of the reference
+ * sizes, so sharing must not be changed by rufl_set_size_sharing() until
+ * the fonts are unpinned.
+ */
+
+rufl_code rufl_font_pin(const struct rufl_sized_font *fonts, size_t count);
+
+
+/**
+ * Allow font handles pinned by rufl_font_pin() to be closed again.
+ */
+
+void rufl_font_unpin(const struct rufl_sized_font *fonts, size_t count);
+
+
 /**
  * Free all resources used by the library.
  */
@@ -0,0 +1,246 @@
+/*
+ * This file is part of RUfl
+ * Licensed under the MIT License,
+ *                http://www.opensource.org/licenses/mit-license
+ */
+
+#include <stdio.h>
+#include <oslib/font.h>
+#include "rufl_internal.h"
+
+/** Number of slots in the glyph advance cache. Must be a power of 2. */
+#define rufl_ADVANCE_CACHE_SIZE 4096
+
+/** Maximum number of uncached glyphs to measure individually per span.
+ * Spans with more misses than this fall back to a single Font_ScanString
+ * over the whole span, so a cold cache never costs much more than the
+ * uncached path. */
+#define rufl_ADVANCE_FILL_LIMIT 32
+
+/** An entry in the glyph advance cache. */
+struct rufl_advance_cache_entry {
+	/** Unicode codepoint, or rufl_ADVANCE_NONE. */
+	uint32_t u;
+#define rufl_ADVANCE_NONE UINT32_MAX
+	/** Font number (index in rufl_font_list). */
+	uint16_t font;
+	/** Font size. */
+	uint16_t size;
+	/** Output context measured in. */
+	uint8_t context;
+	/** Advance width, in millipoints. */
+	int32_t advance;
+};
+
+/** Direct-mapped cache of glyph advances. */
+static struct rufl_advance_cache_entry
+		rufl_advance_cache[rufl_ADVANCE_CACHE_SIZE];
+
+
+static bool rufl_advance_cache_usable(unsigned int font,
+		unsigned int font_size);
+static rufl_code rufl_advance_cache_fill(unsigned int font,
+		unsigned int font_size, uint32_t u, int *advance);
+
+
+/**
+ * Compute the cache slot for a glyph.
+ */
+
+static inline unsigned int rufl_advance_cache_slot(unsigned int font,
+		unsigned int font_size, uint32_t u)
+{
+	uint32_t h = u * 0x9e3779b1u;
+
+	h ^= (font * 0x85ebca6bu) ^ (font_size * 0xc2b2ae35u);
+	h ^= (h >> 16);
+
+	return h & (rufl_ADVANCE_CACHE_SIZE - 1);
+}
+
+
+/**
+ * Measure a span of characters from a single font using cached glyph
+ * advances.
+ *
+ * Glyphs which are not yet cached are measured individually and added to
+ * the cache, up to a limit per call. The cache is only used for fonts
+ * with no kerning data, as the sum of the glyph advances then exactly
+ * equals the width of the span.
+ *
+ * \param  font       font number (index in rufl_font_list)
+ * \param  font_size  font size
+ * \param  s          characters in span
+ * \param  n          number of characters in span
+ * \param  width      updated to width of span, in millipoints
+ * \return  true if the width was determined, false if the span must be
+ *          measured by the Font Manager
+ */
+
+bool rufl_advance_cache_measure(unsigned int font, unsigned int font_size,
+		const uint32_t *s, unsigned int n, int *width)
+{
+	struct rufl_advance_cache_entry *entry;
+	unsigned int fills = 0;
+	unsigned int i;
+	int advance;
+	int total = 0;
+
+	if (!rufl_advance_cache_usable(font, font_size))
+		return false;
+
+	for (i = 0; i != n; i++) {
+		entry = &rufl_advance_cache[rufl_advance_cache_slot(font,
+				font_size, s[i])];
+		if (entry->u == s[i] && entry->font == font &&
+				entry->size == font_size &&
+				entry->context == rufl_output_context) {
+			rufl_stats.advance_cache_hits++;
+			total += entry->advance;
+			continue;
+		}
+
+		rufl_stats.advance_cache_misses++;
+		if (fills == rufl_ADVANCE_FILL_LIMIT)
+			return false;
+		if (rufl_advance_cache_fill(font, font_size, s[i],
+				&advance) != rufl_OK)
+			return false;
+		fills++;
+
+		entry->u = s[i];
+		entry->font = font;
+		entry->size = font_size;
+		entry->context = rufl_output_context;
+		entry->advance = advance;
+		total += advance;
+	}
+
+	*width = total;
+
+	return true;
+}
+
+
+/**
+ * Determine if glyph advances for a font may be cached.
+ */
+
+bool rufl_advance_cache_usable(unsigned int font, unsigned int font_size)
+{
+	int kern_size;
+	int scale;
+	font_f f;
+
+	if (rufl_old_font_manager || 0xffff < font || 0xffff < font_size)
+		return false;
+
+	if (rufl_font_list[font].kerning == rufl_KERNING_UNKNOWN) {
+		if (rufl_find_font_scaled(font, font_size, rufl_encoding_utf8,
+				&f, &scale) != rufl_OK)
+			return false;
+
+		rufl_fm_error = xfont_read_font_metrics(f, 0, 0, 0, 0, 0,
+				0, 0, 0, 0, 0, &kern_size);
+		if (rufl_fm_error) {
+			LOG("xfont_read_font_metrics: 0x%x: %s",
+					rufl_fm_error->errnum,
+					rufl_fm_error->errmess);
+			rufl_fm_error = NULL;
+			/* be pessimistic and never use the cache */
+			kern_size = 1;
+		}
+
+		rufl_font_list[font].kerning = kern_size ?
+				rufl_KERNING_PRESENT : rufl_KERNING_NONE;
+	}
+
+	return rufl_font_list[font].kerning == rufl_KERNING_NONE;
+}
+
+
+/**
+ * Measure the advance of a single glyph using the Font Manager.
+ */
+
+rufl_code rufl_advance_cache_fill(unsigned int font, unsigned int font_size,
+		uint32_t u, int *advance)
+{
+	uint32_t s[2] = { u, 0 };
+	int x_out, y_out;
+	int scale;
+	os_trfm trfm;
+	font_f f;
+	rufl_code code;
+
+	code = rufl_find_font_scaled(font, font_size, rufl_encoding_utf8,
+			&f, &scale);
+	if (code != rufl_OK)
+		return code;
+	trfm.entries[0][0] = trfm.entries[1][1] = scale;
+	trfm.entries[0][1] = trfm.entries[1][0] = 0;
+	trfm.entries[2][0] = trfm.entries[2][1] = 0;
+
+	rufl_stats.font_scan_string++;
+	rufl_fm_error = xfont_scan_string(f, (const char *) s,
+			font_GIVEN_LENGTH | font_GIVEN_FONT |
+			font_GIVEN32_BIT | (scale ? font_GIVEN_TRFM : 0),
+			0x7fffffff, 0x7fffffff, 0, &trfm, 4,
+			0, &x_out, &y_out, 0);
+	if (rufl_fm_error) {
+		LOG("xfont_scan_string: 0x%x: %s",
+				rufl_fm_error->errnum,
+				rufl_fm_error->errmess);
+		return rufl_FONT_MANAGER_ERROR;
+	}
+
+	*advance = x_out;
+
+	return rufl_OK;
+}
+
+
+/**
+ * Empty the glyph advance cache.
+ */
+
+void rufl_advance_cache_flush(void)
+{
+	unsigned int i;
+
+	for (i = 0; i != rufl_ADVANCE_CACHE_SIZE; i++)
+		rufl_advance_cache[i].u = rufl_ADVANCE_NONE;
+}
+
+
+/**
+ * Empty the glyph advance cache of an output context.
+ */
+
+void rufl_advance_cache_flush_context(unsigned int context)
+{
+	unsigned int i;
+
+	for (i = 0; i != rufl_ADVANCE_CACHE_SIZE; i++)
+		if (rufl_advance_cache[i].context == context)
+			rufl_advance_cache[i].u = rufl_ADVANCE_NONE;
+}
+
+
+/**
+ * Dump glyph advance cache statistics to stdout.
+ */
+
+void rufl_advance_cache_dump(void)
+{
+	unsigned int i, used = 0;
+
+	for (i = 0; i != rufl_ADVANCE_CACHE_SIZE; i++)
+		if (rufl_advance_cache[i].u != rufl_ADVANCE_NONE)
+			used++;
+
+	printf("  %u/%u slots used, %lu hits, %lu misses\n",
+			used, rufl_ADVANCE_CACHE_SIZE,
+			rufl_stats.advance_cache_hits,
+			rufl_stats.advance_cache_misses);
+}
@@ -0,0 +1,197 @@
+/*
+ * This file is part of RUfl
+ * Licensed under the MIT License,
+ *                http://www.opensource.org/licenses/mit-license
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include "rufl_internal.h"
+
+
+static rufl_code rufl_break_lines_measure(const struct rufl_layout *layout,
+		size_t *run, size_t start, size_t end, int *width);
+
+
+/**
+ * Break a paragraph of Unicode text into lines.
+ *
+ * The string is decoded and split into font runs once. For each line, each
+ * run is scanned once by the Font Manager against the remaining width,
+ * splitting at the last space which fits, so kerning is applied as when
+ * painting. Only where the break is in an earlier run, or follows several
+ * spaces, is the line measured again.
+ *
+ * \param  font_family   name of font family
+ * \param  font_style    font style
+ * \param  font_size     size of font in 16ths of a point
+ * \param  string        UTF-8 string
+ * \param  length        length of string in bytes
+ * \param  widths        maximum width of each line
+ * \param  widths_count  number of entries in widths, at least 1
+ * \param  lines         updated to the lines found
+ * \param  max_lines     number of entries in lines
+ * \param  line_count    updated to number of lines found
+ * \return  rufl_OK on success, even if max_lines lines did not reach the
+ *          end of the string, or an error code
+ */
+
+rufl_code rufl_break_lines(const char *font_family, rufl_style font_style,
+		unsigned int font_size,
+		const char *string, size_t length,
+		const int *widths, size_t widths_count,
+		struct rufl_line *lines, size_t max_lines,
+		size_t *line_count)
+{
+	struct rufl_layout layout = { 0 };
+	struct rufl_character_set *charset;
+	const struct rufl_layout_run *r;
+	size_t line = 0, i, brk, end, stop;
+	size_t run = 0, line_run;
+	size_t offset;
+	size_t n = 0;
+	int width, x;
+	bool measured;
+	rufl_code code;
+
+	assert(widths && widths_count != 0);
+	assert(line_count);
+
+	*line_count = 0;
+	if (max_lines == 0)
+		return rufl_OK;
+
+	code = rufl_find_font_family(font_family, font_style,
+			&layout.font, &layout.slant, &charset);
+	if (code != rufl_OK)
+		return code;
+	layout.font_size = font_size;
+
+	code = rufl_layout_segment(&layout, charset,
+			(const uint8_t *) string, length);
+	if (code != rufl_OK)
+		goto out;
+
+	while (line != layout.length) {
+		width = widths[n < widths_count ? n : widths_count - 1];
+
+		/* scan runs from the start of the line until one does not
+		 * fit, leaving x at s[i] */
+		while (layout.run[run].start + layout.run[run].n <= line)
+			run++;
+		line_run = run;
+		x = 0;
+		i = line;
+		while (i != layout.length) {
+			r = &layout.run[run];
+			stop = r->start + r->n;
+			code = rufl_process_run(rufl_BREAK, layout.s + i,
+					stop - i, r->font, layout.font_size,
+					layout.slant, &x, 0, 0, 0, width,
+					&offset, 0, 0);
+			if (code != rufl_OK)
+				goto out;
+			i += offset;
+			if (i != stop)
+				break;
+			run++;
+		}
+
+		/* break at s[brk], which is a space or the end */
+		measured = true;
+		brk = i;
+		if (i != layout.length && layout.s[i] != 0x20) {
+			/* no space which fits was found in this run: break
+			 * at the last space in an earlier run, or if there
+			 * is none, after the word, which goes on the line by
+			 * itself */
+			measured = false;
+			while (brk != line && layout.s[brk - 1] != 0x20)
+				brk--;
+			if (brk != line)
+				brk--;
+			else
+				while (brk != layout.length &&
+						layout.s[brk] != 0x20)
+					brk++;
+		}
+
+		/* the line is s[line..brk) without trailing spaces, and the
+		 * next line starts after the spaces at brk */
+		for (end = brk; end != layout.length &&
+				layout.s[end] == 0x20; end++)
+			;
+		while (brk != line && layout.s[brk - 1] == 0x20) {
+			brk--;
+			measured = false;
+		}
+
+		if (!measured) {
+			run = line_run;
+			code = rufl_break_lines_measure(&layout, &run, line,
+					brk, &x);
+			if (code != rufl_OK)
+				goto out;
+		}
+
+		lines[n].offset = layout.offset[end];
+		lines[n].width = x;
+		line = end;
+		run = line_run;
+		if (++n == max_lines)
+			goto out;
+	}
+
+out:
+	*line_count = n;
+
+	free(layout.s);
+	free(layout.offset);
+	free(layout.run);
+
+	return code;
+}
+
+
+/**
+ * Measure the width of a range of characters in a layout.
+ *
+ * \param  layout  layout containing characters
+ * \param  run     index of a run at or before start, updated to the run
+ *                 containing the last character measured
+ * \param  start   index of first character to measure
+ * \param  end     index after last character to measure
+ * \param  width   updated to width of characters
+ * \return  rufl_OK on success, or an error code
+ */
+
+rufl_code rufl_break_lines_measure(const struct rufl_layout *layout,
+		size_t *run, size_t start, size_t end, int *width)
+{
+	const struct rufl_layout_run *r;
+	size_t stop;
+	size_t offset;
+	int x = 0;
+	rufl_code code;
+
+	while (start != end) {
+		r = &layout->run[*run];
+		if (r->start + r->n <= start) {
+			(*run)++;
+			continue;
+		}
+
+		stop = r->start + r->n < end ? r->start + r->n : end;
+		code = rufl_process_run(rufl_WIDTH, layout->s + start,
+				stop - start, r->font,
+				layout->font_size, layout->slant, &x, 0, 0,
+				0, 0, &offset, 0, 0);
+		if (code != rufl_OK)
+			return code;
+		start = stop;
+	}
+
+	*width = x;
+
+	return rufl_OK;
+}
@@ -66,6 +66,18 @@ void rufl_dump_state(bool verbose)
 
 	printf("rufl_substitution_table:\n");
 	rufl_substitution_table_dump();
+
+	printf("rufl_handle_cache:\n");
+	rufl_handle_cache_dump();
+
+	printf("rufl_advance_cache:\n");
+	rufl_advance_cache_dump();
+
+	printf("rufl_resolve_cache:\n");
+	rufl_resolve_cache_dump();
+
+	printf("rufl_stats:\n");
+	rufl_stats_dump();
 }
 
 
@@ -0,0 +1,83 @@
+/*
+ * This file is part of RUfl
+ * Licensed under the MIT License,
+ *                http://www.opensource.org/licenses/mit-license
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include "rufl_internal.h"
+
+
+/**
+ * Resolve a font family and style to a face.
+ *
+ * The font family is looked up and the weight and slant fallbacks are
+ * applied once, so that the face may then be used for many calls without
+ * repeating this work.
+ *
+ * \param  font_family  name of font family
+ * \param  font_style   font style
+ * \param  face         updated to new face
+ * \return  rufl_OK on success, or an error code
+ */
+
+rufl_code rufl_face_resolve(const char *font_family, rufl_style font_style,
+		rufl_face **face)
+{
+	struct rufl_face *f;
+	rufl_code code;
+
+	assert(face);
+
+	f = malloc(sizeof *f);
+	if (!f)
+		return rufl_OUT_OF_MEMORY;
+
+	code = rufl_face_init(f, font_family, font_style);
+	if (code != rufl_OK) {
+		free(f);
+		return code;
+	}
+
+	*face = f;
+
+	return rufl_OK;
+}
+
+
+/**
+ * Free a face.
+ */
+
+void rufl_face_destroy(rufl_face *face)
+{
+	free(face);
+}
+
+
+/**
+ * Resolve a font family and style into a face.
+ *
+ * \param  face         face to fill in
+ * \param  font_family  name of font family
+ * \param  font_style   font style
+ * \return  rufl_OK on success, or an error code
+ */
+
+rufl_code rufl_face_init(struct rufl_face *face,
+		const char *font_family, rufl_style font_style)
+{
+	struct rufl_character_set *charset;
+	rufl_code code;
+
+	code = rufl_find_font_family(font_family, font_style,
+			&face->font, &face->slant, &charset);
+	if (code != rufl_OK)
+		return code;
+
+	face->charset = charset;
+	rufl_character_set_ascii(charset, &face->ascii);
+
+	return rufl_OK;
+}
@@ -7,6 +7,7 @@
  */
 
 #include <assert.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,9 +15,55 @@
 
 #include "rufl_internal.h"
 
+const char rufl_encoding_utf8[] = "UTF8";
+const char rufl_encoding_latin1[] = "Latin1";
+
+/** Largest number of reference sizes. Sizes above the largest reference
+ * size always use a handle of the exact size. */
+#define rufl_SHARED_SIZES_MAX 1024
+
+/** Smallest size painted with a shared font handle, or 0 if sizes are never
+ * shared. */
+static unsigned int rufl_shared_size_min;
+/** Percentage by which each reference size exceeds the previous one. */
+static unsigned int rufl_shared_size_tolerance;
+/** Reference sizes, in increasing order, starting at rufl_shared_size_min. */
+static unsigned int rufl_shared_sizes[rufl_SHARED_SIZES_MAX];
+/** Number of entries in rufl_shared_sizes. */
+static unsigned int rufl_shared_sizes_count;
+
+/** A family alias, see rufl_set_family_alias(). */
+struct rufl_family_alias {
+	/** Name of the alias. */
+	char *alias;
+	/** Name of the family that it stands for. */
+	char *family;
+	/** Index of the family in rufl_family_list, or rufl_ALIAS_UNRESOLVED
+	 * if the family is not available. */
+	size_t index;
+#	define rufl_ALIAS_UNRESOLVED ((size_t) -1)
+};
+/** Family aliases, kept across rufl_quit() and rufl_init(). */
+static struct rufl_family_alias *rufl_family_aliases;
+/** Number of entries in rufl_family_aliases. */
+static size_t rufl_family_alias_entries;
+
+/** Open-addressed hash index of rufl_family_list and the family aliases,
+ * by case-folded name. Each slot holds an index in rufl_family_list plus
+ * 1, an index in rufl_family_aliases plus rufl_family_list_entries plus 1,
+ * or 0 if empty. */
+static uint32_t *rufl_family_index;
+/** Number of slots in rufl_family_index. Always a power of 2. */
+static size_t rufl_family_index_size;
+
+/** Most recently found family name, and its index in rufl_family_list. */
+static char rufl_family_memo_name[64];
+static size_t rufl_family_memo_family;
+
 static int rufl_family_list_cmp(const void *keyval, const void *datum);
-static rufl_code rufl_place_in_cache(unsigned int font, unsigned int font_size,
-		const char *encoding, font_f f);
+static uint32_t rufl_family_hash(const char *name);
+static void rufl_family_index_add(size_t entry, const char *name);
+static const char **rufl_family_find(const char *font_family);
 
 /**
  * Find a font family.
@@ -30,9 +77,7 @@ rufl_code rufl_find_font_family(const char *font_family,
 	unsigned int weight, slant, used_weight;
 	unsigned int search_direction;
 
-	family = bsearch(font_family, rufl_family_list,
-			rufl_family_list_entries,
-			sizeof rufl_family_list[0], rufl_family_list_cmp);
+	family = rufl_family_find(font_family);
 	if (!family)
 		return rufl_FONT_NOT_FOUND;
 
@@ -92,52 +137,39 @@ rufl_code rufl_find_font(unsigned int font, unsigned int font_size,
 		const char *encoding, font_f *fhandle)
 {
 	font_f f;
-	char font_name[80];
-	unsigned int i;
+	const char *font_name;
+	char *formatted = NULL;
+	int xres, yres;
 	rufl_code code;
 
 	assert(fhandle != NULL);
 
-	for (i = 0; i != rufl_CACHE_SIZE; i++) {
-		/* Comparing pointers for the encoding is fine, as the 
-		 * encoding string passed to us is either:
-		 *
-		 *    a) NULL
-		 * or b) statically allocated
-		 * or c) resides in the font's umap, which is constant
-		 *       for the lifetime of the application.
-		 */
-		if (rufl_cache[i].font == font &&
-				rufl_cache[i].size == font_size &&
-				rufl_cache[i].encoding == encoding)
-			break;
-	}
-	if (i != rufl_CACHE_SIZE) {
-		/* found in cache */
-		f = rufl_cache[i].f;
-		rufl_cache[i].last_used = rufl_cache_time++;
-	} else {
-		/* not found */
-		if (font == rufl_CACHE_CORPUS) {
-			if (encoding)
-				snprintf(font_name, sizeof font_name,
-					"Corpus.Medium\\E%s", encoding);
-			else
-				snprintf(font_name, sizeof font_name,
-					"Corpus.Medium");
-		} else {
-			if (encoding)
-				snprintf(font_name, sizeof font_name,
-					"%s\\E%s",
+	if (!rufl_handle_cache_lookup(font, font_size, encoding, &f)) {
+		/* not found in cache */
+		font_name = rufl_font_name(font, encoding);
+		if (!font_name) {
+			/* not in the name pool, so build it */
+			formatted = rufl_font_name_format(
+					font == rufl_CACHE_CORPUS ?
+					"Corpus.Medium" :
 					rufl_font_list[font].identifier,
 					encoding);
-			else
-				snprintf(font_name, sizeof font_name, "%s",
-					rufl_font_list[font].identifier);
+			if (!formatted)
+				return rufl_OUT_OF_MEMORY;
+			font_name = formatted;
 		}
 
-		rufl_fm_error = xfont_find_font(font_name,
-				font_size, font_size, 0, 0, &f, 0, 0);
+		rufl_handle_cache_resolution(&xres, &yres);
+		do {
+			rufl_stats.font_find_font++;
+			rufl_fm_error = xfont_find_font(font_name,
+					font_size, font_size, xres, yres,
+					&f, 0, 0);
+			/* out of handles: lose a cached one and retry */
+		} while (rufl_fm_error &&
+				rufl_fm_error->errnum == error_FONT_NO_HANDLES &&
+				rufl_handle_cache_reclaim());
+		free(formatted);
 		if (rufl_fm_error) {
 			LOG("xfont_find_font: 0x%x: %s",
 					rufl_fm_error->errnum,
@@ -145,7 +177,7 @@ rufl_code rufl_find_font(unsigned int font, unsigned int font_size,
 			return rufl_FONT_MANAGER_ERROR;
 		}
 		/* place in cache */
-		code = rufl_place_in_cache(font, font_size, encoding, f);
+		code = rufl_handle_cache_insert(font, font_size, encoding, f);
 		if (code != rufl_OK)
 			return code;
 	}
@@ -156,6 +188,170 @@ rufl_code rufl_find_font(unsigned int font, unsigned int font_size,
 }
 
 
+/**
+ * Find a handle for painting or measuring a sized font, which may be a
+ * handle for a nearby reference size when sizes are shared.
+ *
+ * \param  font       font number (index in rufl_font_list)
+ * \param  font_size  font size
+ * \param  encoding   font encoding
+ * \param  fhandle    updated to font handle
+ * \param  scale      updated to scale to apply to the handle, as a 16.16
+ *                    fixed point number, or 0 if the handle has font_size
+ * \return  rufl_OK on success, or an error code
+ */
+
+rufl_code rufl_find_font_scaled(unsigned int font, unsigned int font_size,
+		const char *encoding, font_f *fhandle, int *scale)
+{
+	unsigned int size = rufl_shared_size(font_size);
+
+	*scale = 0;
+
+	if (size == font_size)
+		return rufl_find_font(font, font_size, encoding, fhandle);
+
+	rufl_stats.shared_size_lookups++;
+	*scale = ((uint64_t) font_size << 16) / size;
+
+	return rufl_find_font(font, size, encoding, fhandle);
+}
+
+
+/**
+ * Find the size of the handle used for a font size by
+ * rufl_find_font_scaled().
+ *
+ * \param  font_size  font size
+ * \return  reference size which font_size shares a handle with, or
+ *          font_size if it has a handle of its own
+ */
+
+unsigned int rufl_shared_size(unsigned int font_size)
+{
+	unsigned int lo = 0, hi = rufl_shared_sizes_count, mid;
+
+	if (rufl_shared_size_min == 0 || font_size <= rufl_shared_size_min ||
+			rufl_shared_sizes[hi - 1] < font_size)
+		return font_size;
+
+	/* largest reference size not above font_size */
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (rufl_shared_sizes[mid] <= font_size)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return rufl_shared_sizes[lo];
+}
+
+
+/**
+ * Share font handles between sizes, painting and measuring through a
+ * scaling transform.
+ *
+ * \param  min_size   smallest size to share, in 16ths of a point, or 0 to
+ *                    always use a handle of the exact size
+ * \param  tolerance  percentage by which each reference size exceeds the
+ *                    previous one, starting from min_size
+ */
+
+void rufl_set_size_sharing(unsigned int min_size, unsigned int tolerance)
+{
+	uint64_t size, next;
+
+	if (min_size == rufl_shared_size_min &&
+			(min_size == 0 || tolerance == rufl_shared_size_tolerance))
+		return;
+
+	rufl_shared_size_min = min_size;
+	rufl_shared_size_tolerance = tolerance;
+
+	rufl_shared_sizes_count = 0;
+	for (size = min_size; size != 0 && size <= UINT_MAX &&
+			rufl_shared_sizes_count != rufl_SHARED_SIZES_MAX;
+			size = next) {
+		rufl_shared_sizes[rufl_shared_sizes_count++] = size;
+		next = size + size * tolerance / 100;
+		if (next == size)
+			next++;
+	}
+
+	/* advances measured with the old setting may differ */
+	rufl_advance_cache_flush();
+}
+
+
+/**
+ * Make a name stand for a font family wherever a family name is accepted.
+ *
+ * \param  alias        name of the alias
+ * \param  font_family  name of the family, or 0 to remove the alias
+ * \return  rufl_OK on success, or rufl_OUT_OF_MEMORY
+ */
+
+rufl_code rufl_set_family_alias(const char *alias, const char *font_family)
+{
+	struct rufl_family_alias *aliases;
+	char *name, *family = NULL;
+	size_t i;
+
+	for (i = 0; i != rufl_family_alias_entries; i++)
+		if (strcasecmp(alias, rufl_family_aliases[i].alias) == 0)
+			break;
+
+	if (font_family) {
+		family = strdup(font_family);
+		if (!family)
+			return rufl_OUT_OF_MEMORY;
+	}
+
+	if (i != rufl_family_alias_entries) {
+		/* change or remove an existing alias */
+		free(rufl_family_aliases[i].family);
+		if (family) {
+			rufl_family_aliases[i].family = family;
+		} else {
+			free(rufl_family_aliases[i].alias);
+			rufl_family_aliases[i] = rufl_family_aliases[
+					--rufl_family_alias_entries];
+			if (!rufl_family_alias_entries) {
+				free(rufl_family_aliases);
+				rufl_family_aliases = NULL;
+			}
+		}
+	} else if (family) {
+		aliases = realloc(rufl_family_aliases,
+				(rufl_family_alias_entries + 1) *
+				sizeof rufl_family_aliases[0]);
+		if (!aliases) {
+			free(family);
+			return rufl_OUT_OF_MEMORY;
+		}
+		rufl_family_aliases = aliases;
+
+		name = strdup(alias);
+		if (!name) {
+			free(family);
+			return rufl_OUT_OF_MEMORY;
+		}
+		aliases[rufl_family_alias_entries].alias = name;
+		aliases[rufl_family_alias_entries].family = family;
+		aliases[rufl_family_alias_entries].index =
+				rufl_ALIAS_UNRESOLVED;
+		rufl_family_alias_entries++;
+	}
+
+	/* once initialised, resolve the aliases again */
+	if (rufl_family_index)
+		return rufl_family_index_init();
+
+	return rufl_OK;
+}
+
+
 int rufl_family_list_cmp(const void *keyval, const void *datum)
 {
 	const char *key = keyval;
@@ -165,37 +361,150 @@ int rufl_family_list_cmp(const void *keyval, const void *datum)
 
 
 /**
- * Place a font into the recent-use cache, making space if necessary.
+ * Build the hash index of rufl_family_list.
+ *
+ * Called by rufl_init() once the family list is complete.
+ *
+ * \return  rufl_OK on success, or rufl_OUT_OF_MEMORY
  */
 
-rufl_code rufl_place_in_cache(unsigned int font, unsigned int font_size,
-		const char *encoding, font_f f)
+rufl_code rufl_family_index_init(void)
 {
-	unsigned int i;
-	unsigned int max_age = 0;
-	unsigned int evict = 0;
+	struct rufl_family_alias *a;
+	const char **family;
+	size_t size = 16;
+	size_t i;
 
-	for (i = 0; i != rufl_CACHE_SIZE; i++) {
-		if (rufl_cache[i].font == rufl_CACHE_NONE) {
-			evict = i;
-			break;
-		} else if (max_age < rufl_cache_time -
-				rufl_cache[i].last_used) {
-			max_age = rufl_cache_time -
-					rufl_cache[i].last_used;
-			evict = i;
+	rufl_family_index_free();
+
+	/* at most half full */
+	while (size < 2 * (rufl_family_list_entries +
+			rufl_family_alias_entries))
+		size *= 2;
+
+	rufl_family_index = calloc(size, sizeof rufl_family_index[0]);
+	if (!rufl_family_index)
+		return rufl_OUT_OF_MEMORY;
+	rufl_family_index_size = size;
+
+	for (i = 0; i != rufl_family_list_entries; i++)
+		rufl_family_index_add(i, rufl_family_list[i]);
+
+	/* real families are added first, so are found before aliases */
+	for (i = 0; i != rufl_family_alias_entries; i++) {
+		a = &rufl_family_aliases[i];
+		family = bsearch(a->family, rufl_family_list,
+				rufl_family_list_entries,
+				sizeof rufl_family_list[0],
+				rufl_family_list_cmp);
+		if (!family) {
+			LOG("alias \"%s\": family \"%s\" not available",
+					a->alias, a->family);
+			a->index = rufl_ALIAS_UNRESOLVED;
+			continue;
 		}
+		a->index = family - rufl_family_list;
+		rufl_family_index_add(rufl_family_list_entries + i, a->alias);
 	}
-	if (rufl_cache[evict].font != rufl_CACHE_NONE) {
-		rufl_fm_error = xfont_lose_font(rufl_cache[evict].f);
-		if (rufl_fm_error)
-			return rufl_FONT_MANAGER_ERROR;
-	}
-	rufl_cache[evict].font = font;
-	rufl_cache[evict].size = font_size;
-	rufl_cache[evict].encoding = encoding;
-	rufl_cache[evict].f = f;
-	rufl_cache[evict].last_used = rufl_cache_time++;
 
 	return rufl_OK;
 }
+
+
+/**
+ * Add a family or alias to the hash index.
+ *
+ * \param  entry  value for the index, less 1
+ * \param  name   name of the family or alias
+ */
+
+void rufl_family_index_add(size_t entry, const char *name)
+{
+	size_t j;
+
+	j = rufl_family_hash(name) & (rufl_family_index_size - 1);
+	while (rufl_family_index[j])
+		j = (j + 1) & (rufl_family_index_size - 1);
+	rufl_family_index[j] = entry + 1;
+}
+
+
+/**
+ * Free the hash index of rufl_family_list.
+ */
+
+void rufl_family_index_free(void)
+{
+	free(rufl_family_index);
+	rufl_family_index = NULL;
+	rufl_family_index_size = 0;
+	rufl_family_memo_name[0] = 0;
+}
+
+
+/**
+ * Find a font family by name, ignoring case.
+ *
+ * \param  font_family  name of font family
+ * \return  entry in rufl_family_list, or 0 if not found
+ */
+
+const char **rufl_family_find(const char *font_family)
+{
+	const char *name;
+	size_t j, entry, family;
+
+	if (!rufl_family_index)
+		return bsearch(font_family, rufl_family_list,
+				rufl_family_list_entries,
+				sizeof rufl_family_list[0],
+				rufl_family_list_cmp);
+
+	if (rufl_family_memo_name[0] &&
+			strcmp(font_family, rufl_family_memo_name) == 0)
+		return &rufl_family_list[rufl_family_memo_family];
+
+	for (j = rufl_family_hash(font_family) & (rufl_family_index_size - 1);
+			rufl_family_index[j];
+			j = (j + 1) & (rufl_family_index_size - 1)) {
+		entry = rufl_family_index[j] - 1;
+		if (entry < rufl_family_list_entries) {
+			name = rufl_family_list[entry];
+			family = entry;
+		} else {
+			entry -= rufl_family_list_entries;
+			name = rufl_family_aliases[entry].alias;
+			family = rufl_family_aliases[entry].index;
+		}
+		if (strcasecmp(font_family, name) == 0) {
+			if (strlen(font_family) <
+					sizeof rufl_family_memo_name) {
+				strcpy(rufl_family_memo_name, font_family);
+				rufl_family_memo_family = family;
+			}
+			return &rufl_family_list[family];
+		}
+	}
+
+	return 0;
+}
+
+
+/**
+ * Hash a font family name, ignoring the case of ASCII letters as
+ * strcasecmp() does.
+ */
+
+uint32_t rufl_family_hash(const char *name)
+{
+	uint32_t h = 2166136261u;
+	unsigned char c;
+
+	for (; (c = *name); name++) {
+		if ('A' <= c && c <= 'Z')
+			c += 'a' - 'A';
+		h = (h ^ c) * 16777619u;
+	}
+
+	return h;
+}
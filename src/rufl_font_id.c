@@ -0,0 +1,229 @@
+/*
+ * This file is part of RUfl
+ * Licensed under the MIT License,
+ *                http://www.opensource.org/licenses/mit-license
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rufl_internal.h"
+
+
+/** Font Manager names of every font in every encoding, each terminated by
+ * 0. Entries of rufl_font_name_table point into this. */
+static char *rufl_font_name_pool;
+/** Font Manager names, in order of font and then encoding. The names
+ * member of each rufl_font_list entry points into this. */
+static const char **rufl_font_name_table;
+
+
+static size_t rufl_font_name_encodings(
+		const struct rufl_font_list_entry *entry);
+static const char *rufl_font_name_encoding(
+		const struct rufl_font_list_entry *entry, size_t i);
+
+
+/**
+ * Build the Font Manager names of every font in every encoding.
+ *
+ * Called by rufl_init() once the fonts have been scanned. All names are
+ * held in a single pool, so finding a font never formats its name.
+ *
+ * \return  rufl_OK on success, or rufl_OUT_OF_MEMORY
+ */
+
+rufl_code rufl_font_names_init(void)
+{
+	const struct rufl_font_list_entry *entry;
+	const char *encoding;
+	size_t pool_size = 0, table_size = 0;
+	size_t font, i, n;
+	char *name;
+
+	rufl_font_names_free();
+
+	for (font = 0; font != rufl_font_list_entries; font++) {
+		entry = &rufl_font_list[font];
+		n = rufl_font_name_encodings(entry);
+		for (i = 0; i != n; i++) {
+			encoding = rufl_font_name_encoding(entry, i);
+			pool_size += strlen(entry->identifier) + 1;
+			if (encoding)
+				pool_size += 2 + strlen(encoding);
+		}
+		table_size += n;
+	}
+
+	rufl_font_name_pool = malloc(pool_size ? pool_size : 1);
+	rufl_font_name_table = malloc((table_size ? table_size : 1) *
+			sizeof rufl_font_name_table[0]);
+	if (!rufl_font_name_pool || !rufl_font_name_table) {
+		rufl_font_names_free();
+		return rufl_OUT_OF_MEMORY;
+	}
+
+	name = rufl_font_name_pool;
+	table_size = 0;
+	for (font = 0; font != rufl_font_list_entries; font++) {
+		entry = &rufl_font_list[font];
+		n = rufl_font_name_encodings(entry);
+		rufl_font_list[font].names = &rufl_font_name_table[table_size];
+		for (i = 0; i != n; i++) {
+			encoding = rufl_font_name_encoding(entry, i);
+			rufl_font_name_table[table_size++] = name;
+			if (encoding)
+				name += sprintf(name, "%s\\E%s",
+						entry->identifier,
+						encoding) + 1;
+			else
+				name += sprintf(name, "%s",
+						entry->identifier) + 1;
+		}
+	}
+
+	return rufl_OK;
+}
+
+
+/**
+ * Free the Font Manager names built by rufl_font_names_init().
+ */
+
+void rufl_font_names_free(void)
+{
+	size_t font;
+
+	for (font = 0; font != rufl_font_list_entries; font++)
+		rufl_font_list[font].names = NULL;
+
+	free(rufl_font_name_pool);
+	rufl_font_name_pool = NULL;
+	free(rufl_font_name_table);
+	rufl_font_name_table = NULL;
+}
+
+
+/**
+ * Find the Font Manager name of a font in an encoding.
+ *
+ * \param  font      font number (index in rufl_font_list), or
+ *                   rufl_CACHE_CORPUS
+ * \param  encoding  font encoding, compared by pointer, or 0 for none
+ * \return  font name, or 0 if it is not in the pool
+ */
+
+const char *rufl_font_name(unsigned int font, const char *encoding)
+{
+	const struct rufl_font_list_entry *entry;
+	size_t i;
+
+	if (font == rufl_CACHE_CORPUS) {
+		if (!encoding)
+			return "Corpus.Medium";
+		else if (encoding == rufl_encoding_latin1)
+			return "Corpus.Medium\\ELatin1";
+		else if (encoding == rufl_encoding_utf8)
+			return "Corpus.Medium\\EUTF8";
+		return 0;
+	}
+
+	entry = &rufl_font_list[font];
+	if (!encoding)
+		return entry->identifier;
+	if (!entry->names)
+		return 0;
+
+	if (!rufl_old_font_manager)
+		return encoding == rufl_encoding_utf8 ? entry->names[0] : 0;
+
+	for (i = 0; i != entry->num_umaps; i++)
+		if (entry->umap[i].encoding == encoding)
+			return entry->names[i];
+
+	return 0;
+}
+
+
+/**
+ * Format the Font Manager name of a font in an encoding.
+ *
+ * Used where the name is not in the pool, such as while scanning fonts.
+ *
+ * \param  identifier  font identifier
+ * \param  encoding    font encoding, or 0 for none
+ * \return  font name, to be freed by the caller, or 0 if memory is
+ *          exhausted
+ */
+
+char *rufl_font_name_format(const char *identifier, const char *encoding)
+{
+	size_t size = strlen(identifier) + 1;
+	char *name;
+
+	if (encoding)
+		size += 2 + strlen(encoding);
+
+	name = malloc(size);
+	if (!name)
+		return 0;
+
+	if (encoding)
+		snprintf(name, size, "%s\\E%s", identifier, encoding);
+	else
+		snprintf(name, size, "%s", identifier);
+
+	return name;
+}
+
+
+/**
+ * Find the Font Manager name of a font id.
+ *
+ * \param  font_id  font id, as passed to a rufl_callback_id_t
+ * \return  font name, or 0 if the id is invalid
+ */
+
+const char *rufl_font_id_name(rufl_font_id font_id)
+{
+	unsigned int font = font_id >> 8;
+	unsigned int encoding = font_id & 0xff;
+	struct rufl_font_list_entry *entry;
+
+	if (font_id == rufl_FONT_ID_CORPUS)
+		return "Corpus.Medium\\ELatin1";
+
+	if (rufl_font_list_entries <= font)
+		return 0;
+	entry = &rufl_font_list[font];
+
+	if (!entry->names || rufl_font_name_encodings(entry) <= encoding)
+		return 0;
+
+	return entry->names[encoding];
+}
+
+
+/**
+ * Count the encodings that a font is used in.
+ */
+
+static size_t rufl_font_name_encodings(
+		const struct rufl_font_list_entry *entry)
+{
+	return rufl_old_font_manager ? entry->num_umaps : 1;
+}
+
+
+/**
+ * Find the name of an encoding that a font is used in.
+ *
+ * \return  encoding name, or 0 for a symbol font
+ */
+
+static const char *rufl_font_name_encoding(
+		const struct rufl_font_list_entry *entry, size_t i)
+{
+	return rufl_old_font_manager ? entry->umap[i].encoding :
+			rufl_encoding_utf8;
+}
@@ -0,0 +1,645 @@
+/*
+ * This file is part of RUfl
+ * Licensed under the MIT License,
+ *                http://www.opensource.org/licenses/mit-license
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <oslib/font.h>
+#include "rufl_internal.h"
+
+
+/** An entry in the font handle cache. */
+struct rufl_cache_entry {
+	/** Font number (index in rufl_font_list), or rufl_CACHE_*. */
+	uint32_t font;
+	/** Font size. */
+	uint32_t size;
+	/** Font encoding */
+	const char *encoding;
+	/** RISC OS font handle. */
+	font_f f;
+	/** Next entry in the same hash chain, or in the free list. */
+	uint32_t next;
+	/** Adjacent entries in order of use, or rufl_CACHE_END. Pinned
+	 * entries are not in this list, so are never evicted. */
+	uint32_t newer, older;
+	/** Number of times pinned by rufl_handle_cache_pin(). */
+	uint32_t pins;
+};
+/** End of a list of entries. */
+#define rufl_CACHE_END UINT32_MAX
+
+/** The font handles of an output context. */
+struct rufl_handle_cache {
+	/** Cache entries, capacity entries. */
+	struct rufl_cache_entry *entry;
+	/** Number of entries allocated. */
+	size_t capacity;
+	/** Number of entries in use. */
+	size_t used;
+	/** Hash table of chains of entries, buckets entries. */
+	uint32_t *hash;
+	/** Number of hash chains. Always a power of 2. */
+	size_t buckets;
+	/** List of unused entries. */
+	uint32_t free;
+	/** Most and least recently used entries. */
+	uint32_t newest, oldest;
+	/** Resolution for Font_FindFont, or 0 for the current mode's. */
+	int xres, yres;
+};
+
+/** Font handles of each output context. */
+static struct rufl_handle_cache rufl_handle_caches[rufl_CONTEXTS] = {
+	{ 0, 0, 0, 0, 0, rufl_CACHE_END, rufl_CACHE_END, rufl_CACHE_END,
+			0, 0 },
+	{ 0, 0, 0, 0, 0, rufl_CACHE_END, rufl_CACHE_END, rufl_CACHE_END,
+			0, 0 },
+	{ 0, 0, 0, 0, 0, rufl_CACHE_END, rufl_CACHE_END, rufl_CACHE_END,
+			0, 0 },
+};
+/** Font handles of the current output context. */
+static struct rufl_handle_cache *rufl_hc = &rufl_handle_caches[0];
+/** Maximum number of font handles to keep open in each context. */
+static size_t rufl_cache_limit = rufl_CACHE_SIZE;
+/** Number of font handles kept open in each context, reduced below
+ * rufl_cache_limit while the Font Manager is short of handles. */
+static size_t rufl_cache_effective_limit = rufl_CACHE_SIZE;
+/** Font handles placed in the cache since the effective limit changed. */
+static unsigned int rufl_cache_recovery;
+
+rufl_context rufl_output_context = rufl_CONTEXT_SCREEN;
+
+
+static uint32_t rufl_handle_cache_find(unsigned int font,
+		unsigned int font_size, const char *encoding);
+static rufl_code rufl_handle_cache_grow(size_t capacity);
+static rufl_code rufl_handle_cache_evict(void);
+static rufl_code rufl_handle_cache_remove(uint32_t i);
+static void rufl_handle_cache_unlink(uint32_t i);
+static void rufl_handle_cache_link_newest(uint32_t i);
+
+
+/**
+ * Compute the hash chain for a sized font.
+ */
+
+static inline uint32_t rufl_handle_cache_bucket(unsigned int font,
+		unsigned int font_size, const char *encoding)
+{
+	uint32_t h = font * 0x9e3779b1u;
+
+	h ^= font_size * 0x85ebca6bu;
+	h ^= (uint32_t) ((uintptr_t) encoding >> 2) * 0xc2b2ae35u;
+	h ^= h >> 16;
+
+	return h & (rufl_hc->buckets - 1);
+}
+
+
+/**
+ * Look for a sized font in the cache, and mark it as most recently used.
+ *
+ * \param  font       font number (index in rufl_font_list), or
+ *                    rufl_CACHE_CORPUS
+ * \param  font_size  font size
+ * \param  encoding   font encoding, compared by pointer
+ * \param  f          updated to font handle, if found
+ * \return  true if found, false if not in the cache
+ */
+
+bool rufl_handle_cache_lookup(unsigned int font, unsigned int font_size,
+		const char *encoding, font_f *f)
+{
+	uint32_t i;
+
+	i = rufl_handle_cache_find(font, font_size, encoding);
+	if (i == rufl_CACHE_END) {
+		rufl_stats.handle_cache_misses++;
+		return false;
+	}
+	rufl_stats.handle_cache_hits++;
+
+	if (!rufl_hc->entry[i].pins && rufl_hc->newest != i) {
+		rufl_handle_cache_unlink(i);
+		rufl_handle_cache_link_newest(i);
+	}
+
+	*f = rufl_hc->entry[i].f;
+
+	return true;
+}
+
+
+/**
+ * Place a font handle in the cache, making space if necessary.
+ *
+ * The least recently used handle is lost if the cache is full.
+ *
+ * \param  font       font number (index in rufl_font_list), or
+ *                    rufl_CACHE_CORPUS
+ * \param  font_size  font size
+ * \param  encoding   font encoding
+ * \param  f          font handle, now owned by the cache
+ * \return  rufl_OK on success, or an error code
+ */
+
+rufl_code rufl_handle_cache_insert(unsigned int font, unsigned int font_size,
+		const char *encoding, font_f f)
+{
+	uint32_t *chain;
+	uint32_t i;
+	rufl_code code;
+
+	/* after a shortage of handles, slowly return to the full limit */
+	if (rufl_cache_effective_limit < rufl_cache_limit &&
+			++rufl_cache_recovery == rufl_CACHE_RECOVERY) {
+		rufl_cache_effective_limit++;
+		rufl_cache_recovery = 0;
+	}
+
+	/* pinned entries may take the cache over its limit */
+	while (rufl_cache_effective_limit <= rufl_hc->used &&
+			rufl_hc->oldest != rufl_CACHE_END) {
+		rufl_stats.handle_cache_evictions++;
+		code = rufl_handle_cache_evict();
+		if (code != rufl_OK)
+			return code;
+	}
+
+	if (rufl_hc->free == rufl_CACHE_END) {
+		code = rufl_handle_cache_grow(rufl_cache_effective_limit);
+		if (code != rufl_OK)
+			return code;
+	}
+
+	i = rufl_hc->free;
+	rufl_hc->free = rufl_hc->entry[i].next;
+
+	rufl_hc->entry[i].font = font;
+	rufl_hc->entry[i].size = font_size;
+	rufl_hc->entry[i].encoding = encoding;
+	rufl_hc->entry[i].f = f;
+	rufl_hc->entry[i].pins = 0;
+
+	chain = &rufl_hc->hash[rufl_handle_cache_bucket(font, font_size,
+			encoding)];
+	rufl_hc->entry[i].next = *chain;
+	*chain = i;
+	rufl_handle_cache_link_newest(i);
+	rufl_hc->used++;
+
+	return rufl_OK;
+}
+
+
+/**
+ * Lose a font handle after the Font Manager ran out of handles, so that
+ * Font_FindFont may be retried, and keep fewer handles from now on.
+ *
+ * The least recently used unpinned handle of the current output context
+ * is lost, or of another context if the current one has none. Nothing is
+ * counted or changed if every handle is pinned.
+ *
+ * \return  true if a handle was lost, false if every handle is pinned
+ */
+
+bool rufl_handle_cache_reclaim(void)
+{
+	struct rufl_handle_cache *current = rufl_hc;
+	size_t limit = 1 < rufl_hc->used ? rufl_hc->used - 1 : 1;
+	unsigned int i;
+
+	for (i = 0; i != rufl_CONTEXTS; i++) {
+		rufl_hc = &rufl_handle_caches[(rufl_output_context + i) %
+				rufl_CONTEXTS];
+		if (rufl_hc->oldest != rufl_CACHE_END)
+			break;
+	}
+	if (i == rufl_CONTEXTS) {
+		rufl_hc = current;
+		return false;
+	}
+
+	rufl_stats.handle_exhaustions++;
+	if (limit < rufl_cache_effective_limit)
+		rufl_cache_effective_limit = limit;
+	rufl_cache_recovery = 0;
+
+	rufl_stats.handle_cache_evictions++;
+	/* the handle is gone even if losing it failed */
+	rufl_handle_cache_evict();
+	rufl_hc = current;
+
+	return true;
+}
+
+
+/**
+ * Exempt a font handle in the cache from eviction.
+ *
+ * Pins are counted, so each call must be matched by a call to
+ * rufl_handle_cache_unpin().
+ *
+ * \param  font       font number (index in rufl_font_list), or
+ *                    rufl_CACHE_CORPUS
+ * \param  font_size  font size
+ * \param  encoding   font encoding
+ * \return  true if pinned, false if not in the cache
+ */
+
+bool rufl_handle_cache_pin(unsigned int font, unsigned int font_size,
+		const char *encoding)
+{
+	uint32_t i;
+
+	i = rufl_handle_cache_find(font, font_size, encoding);
+	if (i == rufl_CACHE_END)
+		return false;
+
+	if (rufl_hc->entry[i].pins++ == 0)
+		rufl_handle_cache_unlink(i);
+
+	return true;
+}
+
+
+/**
+ * Allow a font handle pinned by rufl_handle_cache_pin() to be evicted
+ * again, once it has been unpinned as many times as it was pinned.
+ *
+ * \param  font       font number (index in rufl_font_list), or
+ *                    rufl_CACHE_CORPUS
+ * \param  font_size  font size
+ * \param  encoding   font encoding
+ */
+
+void rufl_handle_cache_unpin(unsigned int font, unsigned int font_size,
+		const char *encoding)
+{
+	uint32_t i;
+
+	i = rufl_handle_cache_find(font, font_size, encoding);
+	if (i == rufl_CACHE_END || rufl_hc->entry[i].pins == 0)
+		return;
+
+	if (--rufl_hc->entry[i].pins == 0)
+		rufl_handle_cache_link_newest(i);
+}
+
+
+/**
+ * Lose all font handles of the current output context, including pinned
+ * handles.
+ */
+
+void rufl_handle_cache_flush(void)
+{
+	size_t i;
+
+	for (i = 0; i != rufl_hc->capacity; i++)
+		if (rufl_hc->entry[i].font != rufl_CACHE_NONE)
+			rufl_handle_cache_remove(i);
+}
+
+
+/**
+ * Lose the font handles of every output context, free their memory, and
+ * return to the screen context.
+ */
+
+void rufl_handle_cache_fini(void)
+{
+	unsigned int i;
+
+	for (i = 0; i != rufl_CONTEXTS; i++) {
+		rufl_hc = &rufl_handle_caches[i];
+		rufl_handle_cache_flush();
+
+		free(rufl_hc->entry);
+		rufl_hc->entry = NULL;
+		rufl_hc->capacity = 0;
+		free(rufl_hc->hash);
+		rufl_hc->hash = NULL;
+		rufl_hc->buckets = 0;
+		rufl_hc->free = rufl_CACHE_END;
+	}
+
+	rufl_output_context = rufl_CONTEXT_SCREEN;
+	rufl_hc = &rufl_handle_caches[rufl_CONTEXT_SCREEN];
+}
+
+
+/**
+ * Read the resolution to open fonts at in the current output context.
+ *
+ * \param  xres  updated to x resolution, or 0 for the current mode's
+ * \param  yres  updated to y resolution, or 0 for the current mode's
+ */
+
+void rufl_handle_cache_resolution(int *xres, int *yres)
+{
+	*xres = rufl_hc->xres;
+	*yres = rufl_hc->yres;
+}
+
+
+/**
+ * Select the output context that following calls render to.
+ *
+ * \param  context  output context
+ */
+
+void rufl_set_output_context(rufl_context context)
+{
+	assert(context < rufl_CONTEXTS);
+
+	rufl_output_context = context;
+	rufl_hc = &rufl_handle_caches[context];
+}
+
+
+/**
+ * Set the resolution that fonts are opened at in an output context.
+ *
+ * Any font handles of the context which were opened at a different
+ * resolution are lost, with the glyph advances measured in the context.
+ *
+ * \param  context  output context
+ * \param  xres     x resolution in dots per inch, or 0 for the current mode's
+ * \param  yres     y resolution in dots per inch, or 0 for the current mode's
+ */
+
+void rufl_set_output_context_resolution(rufl_context context,
+		int xres, int yres)
+{
+	struct rufl_handle_cache *current = rufl_hc;
+
+	assert(context < rufl_CONTEXTS);
+
+	rufl_hc = &rufl_handle_caches[context];
+	if (rufl_hc->xres != xres || rufl_hc->yres != yres) {
+		rufl_handle_cache_flush();
+		rufl_advance_cache_flush_context(context);
+		rufl_hc->xres = xres;
+		rufl_hc->yres = yres;
+	}
+	rufl_hc = current;
+}
+
+
+/**
+ * Set the maximum number of font handles that the library keeps open.
+ *
+ * \param  size  number of font handles, clamped to 1 to
+ *               rufl_HANDLE_CACHE_SIZE_MAX
+ * \return  rufl_OK on success, or an error code
+ */
+
+rufl_code rufl_set_handle_cache_size(unsigned int size)
+{
+	struct rufl_handle_cache *current = rufl_hc;
+	unsigned int i;
+	rufl_code code = rufl_OK;
+
+	if (size < 1)
+		size = 1;
+	else if (rufl_HANDLE_CACHE_SIZE_MAX < size)
+		size = rufl_HANDLE_CACHE_SIZE_MAX;
+
+	rufl_cache_limit = size;
+	rufl_cache_effective_limit = size;
+	rufl_cache_recovery = 0;
+
+	for (i = 0; i != rufl_CONTEXTS && code == rufl_OK; i++) {
+		rufl_hc = &rufl_handle_caches[i];
+		while (rufl_cache_limit < rufl_hc->used &&
+				rufl_hc->oldest != rufl_CACHE_END) {
+			rufl_stats.handle_cache_evictions++;
+			code = rufl_handle_cache_evict();
+			if (code != rufl_OK)
+				break;
+		}
+	}
+	rufl_hc = current;
+
+	return code;
+}
+
+
+/**
+ * Dump font handle cache contents to stdout.
+ */
+
+void rufl_handle_cache_dump(void)
+{
+	static const char *const names[rufl_CONTEXTS] =
+			{ "screen", "printer", "sprite" };
+	const struct rufl_handle_cache *c;
+	const struct rufl_cache_entry *e;
+	unsigned int i;
+	uint32_t j;
+
+	for (i = 0; i != rufl_CONTEXTS; i++) {
+		c = &rufl_handle_caches[i];
+		printf("  %s%s: %zu/%zu handles (limit %zu), "
+				"resolution %i x %i\n",
+				names[i],
+				i == rufl_output_context ? " (current)" : "",
+				c->used, rufl_cache_effective_limit,
+				rufl_cache_limit, c->xres, c->yres);
+
+		for (j = 0; j != c->capacity; j++) {
+			e = &c->entry[j];
+			if (e->font == rufl_CACHE_NONE)
+				continue;
+			if (e->font == rufl_CACHE_CORPUS)
+				printf("    Corpus.Medium");
+			else
+				printf("    \"%s\"", rufl_font_list[e->font].
+						identifier);
+			printf(" %s size %u handle %u%s\n",
+					e->encoding ? e->encoding : "-",
+					e->size, (unsigned int) e->f,
+					e->pins ? " (pinned)" : "");
+		}
+	}
+}
+
+
+/**
+ * Find a sized font in the cache.
+ *
+ * \return  index in rufl_hc->entry, or rufl_CACHE_END if not found
+ */
+
+uint32_t rufl_handle_cache_find(unsigned int font, unsigned int font_size,
+		const char *encoding)
+{
+	uint32_t i;
+
+	if (!rufl_hc->used)
+		return rufl_CACHE_END;
+
+	/* Comparing pointers for the encoding is fine, as the
+	 * encoding string passed to us is either:
+	 *
+	 *    a) NULL
+	 * or b) statically allocated (rufl_encoding_*)
+	 * or c) resides in the font's umap, which is constant
+	 *       for the lifetime of the application.
+	 */
+	for (i = rufl_hc->hash[rufl_handle_cache_bucket(font, font_size,
+			encoding)]; i != rufl_CACHE_END;
+			i = rufl_hc->entry[i].next) {
+		if (rufl_hc->entry[i].font == font &&
+				rufl_hc->entry[i].size == font_size &&
+				rufl_hc->entry[i].encoding == encoding)
+			break;
+	}
+
+	return i;
+}
+
+
+/**
+ * Allocate more cache entries, and rebuild the hash table to match.
+ */
+
+rufl_code rufl_handle_cache_grow(size_t capacity)
+{
+	struct rufl_cache_entry *cache;
+	uint32_t *hash;
+	size_t buckets = 16;
+	size_t j;
+	uint32_t i;
+
+	if (capacity <= rufl_hc->capacity)
+		capacity = rufl_hc->capacity + 1;
+
+	cache = realloc(rufl_hc->entry, capacity * sizeof cache[0]);
+	if (!cache)
+		return rufl_OUT_OF_MEMORY;
+	rufl_hc->entry = cache;
+
+	/* keep chains short: at least 2 chains per entry */
+	while (buckets < 2 * capacity)
+		buckets *= 2;
+	if (buckets != rufl_hc->buckets) {
+		hash = malloc(buckets * sizeof hash[0]);
+		if (!hash)
+			return rufl_OUT_OF_MEMORY;
+		free(rufl_hc->hash);
+		rufl_hc->hash = hash;
+		rufl_hc->buckets = buckets;
+
+		for (j = 0; j != buckets; j++)
+			hash[j] = rufl_CACHE_END;
+		for (i = 0; i != rufl_hc->capacity; i++) {
+			uint32_t *chain;
+			if (rufl_hc->entry[i].font == rufl_CACHE_NONE)
+				continue;
+			chain = &hash[rufl_handle_cache_bucket(
+					rufl_hc->entry[i].font,
+					rufl_hc->entry[i].size,
+					rufl_hc->entry[i].encoding)];
+			rufl_hc->entry[i].next = *chain;
+			*chain = i;
+		}
+	}
+
+	for (j = capacity; j != rufl_hc->capacity; j--) {
+		rufl_hc->entry[j - 1].font = rufl_CACHE_NONE;
+		rufl_hc->entry[j - 1].next = rufl_hc->free;
+		rufl_hc->free = j - 1;
+	}
+	rufl_hc->capacity = capacity;
+
+	return rufl_OK;
+}
+
+
+/**
+ * Lose the least recently used font handle which is not pinned.
+ */
+
+rufl_code rufl_handle_cache_evict(void)
+{
+	if (rufl_hc->oldest == rufl_CACHE_END)
+		return rufl_OK;
+
+	return rufl_handle_cache_remove(rufl_hc->oldest);
+}
+
+
+/**
+ * Lose a font handle and free its entry.
+ */
+
+rufl_code rufl_handle_cache_remove(uint32_t i)
+{
+	uint32_t *chain;
+
+	chain = &rufl_hc->hash[rufl_handle_cache_bucket(rufl_hc->entry[i].font,
+			rufl_hc->entry[i].size, rufl_hc->entry[i].encoding)];
+	while (*chain != i)
+		chain = &rufl_hc->entry[*chain].next;
+	*chain = rufl_hc->entry[i].next;
+
+	if (!rufl_hc->entry[i].pins)
+		rufl_handle_cache_unlink(i);
+	rufl_hc->entry[i].font = rufl_CACHE_NONE;
+	rufl_hc->entry[i].next = rufl_hc->free;
+	rufl_hc->free = i;
+	rufl_hc->used--;
+
+	rufl_fm_error = xfont_lose_font(rufl_hc->entry[i].f);
+	if (rufl_fm_error) {
+		LOG("xfont_lose_font: 0x%x: %s",
+				rufl_fm_error->errnum,
+				rufl_fm_error->errmess);
+		return rufl_FONT_MANAGER_ERROR;
+	}
+
+	return rufl_OK;
+}
+
+
+/**
+ * Remove an entry from the list in order of use.
+ */
+
+void rufl_handle_cache_unlink(uint32_t i)
+{
+	struct rufl_cache_entry *e = &rufl_hc->entry[i];
+
+	if (e->newer != rufl_CACHE_END)
+		rufl_hc->entry[e->newer].older = e->older;
+	else
+		rufl_hc->newest = e->older;
+
+	if (e->older != rufl_CACHE_END)
+		rufl_hc->entry[e->older].newer = e->newer;
+	else
+		rufl_hc->oldest = e->newer;
+}
+
+
+/**
+ * Add an entry to the list in order of use, as the most recently used.
+ */
+
+void rufl_handle_cache_link_newest(uint32_t i)
+{
+	rufl_hc->entry[i].newer = rufl_CACHE_END;
+	rufl_hc->entry[i].older = rufl_hc->newest;
+	if (rufl_hc->newest != rufl_CACHE_END)
+		rufl_hc->entry[rufl_hc->newest].newer = i;
+	else
+		rufl_hc->oldest = i;
+	rufl_hc->newest = i;
+}
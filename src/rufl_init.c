@@ -39,8 +39,6 @@ size_t rufl_family_list_entries = 0;
 struct rufl_family_map_entry *rufl_family_map = NULL;
 os_error *rufl_fm_error = NULL;
 void *rufl_family_menu = NULL;
-struct rufl_cache_entry rufl_cache[rufl_CACHE_SIZE];
-uint32_t rufl_cache_time = 0;
 bool rufl_old_font_manager = false;
 static bool rufl_broken_font_enumerate_characters = false;
 wimp_w rufl_status_w = 0;
@@ -133,6 +131,7 @@ rufl_code rufl_init(void)
 	rufl_init_status_open();
 
 	/* determine if the font manager supports Unicode */
+	rufl_stats.font_find_font++;
 	rufl_fm_error = xfont_find_font("Homerton.Medium\\EUTF8", 160, 160,
 			0, 0, &font, 0, 0);
 	if (rufl_fm_error) {
@@ -150,6 +149,7 @@ rufl_code rufl_init(void)
 		/* New font manager; see if character enumeration works */
 		int next;
 
+		rufl_stats.font_enumerate_characters++;
 		rufl_fm_error = xfont_enumerate_characters(font, 0, 
 				&next, NULL);
 		/* Broken if SWI fails or it doesn't return 0x20 as the first
@@ -193,6 +193,14 @@ rufl_code rufl_init(void)
 	LOG("%zu faces, %zu families", rufl_font_list_entries,
 			rufl_family_list_entries);
 
+	code = rufl_family_index_init();
+	if (code != rufl_OK) {
+		LOG("rufl_family_index_init: 0x%x", code);
+		rufl_quit();
+		xhourglass_off();
+		return code;
+	}
+
 	code = rufl_load_cache();
 	if (code != rufl_OK) {
 		LOG("rufl_load_cache: 0x%x", code);
@@ -224,6 +232,14 @@ rufl_code rufl_init(void)
 		changes++;
 	}
 
+	code = rufl_font_names_init();
+	if (code != rufl_OK) {
+		LOG("rufl_font_names_init: 0x%x", code);
+		rufl_quit();
+		xhourglass_off();
+		return code;
+	}
+
 	xhourglass_leds(2, 0, 0);
 	xhourglass_colours(0x0000ff, 0x00ffff, &old_sand, &old_glass);
 	code = rufl_substitution_table_init();
@@ -247,8 +263,9 @@ rufl_code rufl_init(void)
 		}
 	}
 
-	for (i = 0; i != rufl_CACHE_SIZE; i++)
-		rufl_cache[i].font = rufl_CACHE_NONE;
+	rufl_handle_cache_flush();
+	rufl_advance_cache_flush();
+	rufl_resolve_cache_flush();
 
 	code = rufl_init_family_menu();
 	if (code != rufl_OK) {
@@ -369,6 +386,8 @@ rufl_code rufl_init_add_font(const char *identifier, const char *local_name)
 	rufl_font_list[rufl_font_list_entries].charset = NULL;
 	rufl_font_list[rufl_font_list_entries].umap = NULL;
 	rufl_font_list[rufl_font_list_entries].num_umaps = 0;
+	rufl_font_list[rufl_font_list_entries].names = NULL;
+	rufl_font_list[rufl_font_list_entries].kerning = rufl_KERNING_UNKNOWN;
 	rufl_font_list_entries++;
 
 	/* determine family, weight, and slant */
@@ -565,6 +584,7 @@ static rufl_code rufl_init_enumerate_characters(const char *font_name,
 		 * on this version of the Font Manager. Find the first
 		 * codepoint it will report. */
 		unsigned int first;
+		rufl_stats.font_enumerate_characters++;
 		rufl_fm_error = xfont_enumerate_characters(font, 0,
 				(int *) &first, (int *) &internal);
 		if (rufl_fm_error) {
@@ -583,6 +603,7 @@ static rufl_code rufl_init_enumerate_characters(const char *font_name,
 		/* Search the entire space up to the first codepoint it
 		 * reported. */
 		for (u = 1; u != first; u++) {
+			rufl_stats.font_enumerate_characters++;
 			rufl_fm_error = xfont_enumerate_characters(font, u,
 					(int *) &next, (int *) &internal);
 			if (rufl_fm_error) {
@@ -609,6 +630,7 @@ static rufl_code rufl_init_enumerate_characters(const char *font_name,
 
 	/* Scan through mapped characters */
 	for (; u != (unsigned int) -1; u = next) {
+		rufl_stats.font_enumerate_characters++;
 		rufl_fm_error = xfont_enumerate_characters(font, u, 
 				(int *) &next, (int *) &internal);
 		if (rufl_fm_error) {
@@ -670,6 +692,7 @@ static rufl_code find_glyph_cb(void *pw, uint32_t glyph_idx, uint32_t ucs4)
 		rufl_init_status(0, 0);
 
 	string[0] = ucs4;
+	rufl_stats.font_scan_string++;
 	rufl_fm_error = xfont_scan_string(ctx->font, (char *) string,
 			font_RETURN_BBOX | font_GIVEN32_BIT |
 			font_GIVEN_FONT | font_GIVEN_LENGTH |
@@ -732,7 +755,7 @@ static rufl_code find_glyph_cb(void *pw, uint32_t glyph_idx, uint32_t ucs4)
 
 rufl_code rufl_init_scan_font(unsigned int font_index)
 {
-	char font_name[80];
+	char *font_name;
 	struct rufl_character_set *planes[17];
 	struct rufl_character_set *charset;
 	font_f font;
@@ -746,21 +769,27 @@ rufl_code rufl_init_scan_font(unsigned int font_index)
 	for (plane = 0; plane < 17; plane++)
 		planes[plane] = NULL;
 
-	snprintf(font_name, sizeof font_name, "%s\\EUTF8",
-			rufl_font_list[font_index].identifier);
+	font_name = rufl_font_name_format(rufl_font_list[font_index].identifier,
+			rufl_encoding_utf8);
+	if (!font_name)
+		return rufl_OUT_OF_MEMORY;
 
+	rufl_stats.font_find_font++;
 	rufl_fm_error = xfont_find_font(font_name, 160, 160, 0, 0, &font, 0, 0);
 	if (rufl_fm_error) {
 		LOG("xfont_find_font(\"%s\"): 0x%x: %s", font_name,
 				rufl_fm_error->errnum, rufl_fm_error->errmess);
+		free(font_name);
 		return rufl_OK;
 	}
 
 	/* First pass: find the planes we need */
 	rc = rufl_init_enumerate_characters(font_name, font,
 			find_plane_cb, planes);
-	if (rc != rufl_OK)
+	if (rc != rufl_OK) {
+		free(font_name);
 		return rc;
+	}
 
 	/* Allocate the planes */
 	for (plane = 0; plane < 17; plane++) {
@@ -772,6 +801,7 @@ rufl_code rufl_init_scan_font(unsigned int font_index)
 			while (plane > 0)
 				free(planes[plane-1]);
 			xfont_lose_font(font);
+			free(font_name);
 			return rufl_OUT_OF_MEMORY;
 		}
 	}
@@ -787,10 +817,12 @@ rufl_code rufl_init_scan_font(unsigned int font_index)
 		for (plane = 0; plane < 17; plane++)
 			free(planes[plane]);
 		xfont_lose_font(font);
+		free(font_name);
 		return rc;
 	}
 
 	xfont_lose_font(font);
+	free(font_name);
 
 	charset = rufl_init_shrinkwrap_planes(planes);
 	if (!charset) {
@@ -869,6 +901,10 @@ rufl_code rufl_init_scan_font_old(unsigned int font_index)
 		}
 		if (context == -1)
 			break;
+		if (num_umaps == rufl_FONT_ID_ENCODINGS) {
+			LOG("\"%s\" has too many encodings", font_name);
+			break;
+		}
 
 		temp = realloc(umap, (num_umaps + 1) * sizeof *umap);
 		if (!temp) {
@@ -1030,16 +1066,17 @@ rufl_code rufl_init_scan_font_in_encoding(const char *font_name,
 	rufl_code code;
 	font_f font;
 	font_scan_block block = { { 0, 0 }, { 0, 0 }, -1, { 0, 0, 0, 0 } };
-	char buf[80];
+	char *buf;
 
-	if (encoding)
-		snprintf(buf, sizeof buf, "%s\\E%s", font_name, encoding);
-	else
-		snprintf(buf, sizeof buf, "%s", font_name);
+	buf = rufl_font_name_format(font_name, encoding);
+	if (!buf)
+		return rufl_OUT_OF_MEMORY;
 
+	rufl_stats.font_find_font++;
 	rufl_fm_error = xfont_find_font(buf, 160, 160, 0, 0, &font, 0, 0);
 	if (rufl_fm_error) {
 		/* Leave it to our caller to log, if they wish */
+		free(buf);
 		return rufl_FONT_MANAGER_ERROR;
 	}
 
@@ -1049,6 +1086,7 @@ rufl_code rufl_init_scan_font_in_encoding(const char *font_name,
 				buf, code);
 		umap->encoding = NULL;
 		xfont_lose_font(font);
+		free(buf);
 		return code;
 	}
 
@@ -1068,6 +1106,7 @@ rufl_code rufl_init_scan_font_in_encoding(const char *font_name,
 		LOG("%s", "Rejecting UCS font");
 		umap->encoding = NULL;
 		xfont_lose_font(font);
+		free(buf);
 		rufl_fm_error = &err;
 		return rufl_FONT_MANAGER_ERROR;
 	}
@@ -1077,6 +1116,7 @@ rufl_code rufl_init_scan_font_in_encoding(const char *font_name,
 	for (i = 0; i != umap->entries; i++) {
 		u = umap->map[i].u;
 		string[0] = umap->map[i].c;
+		rufl_stats.font_scan_string++;
 		rufl_fm_error = xfont_scan_string(font, (char *) string,
 				font_RETURN_BBOX | font_GIVEN_FONT |
 				font_GIVEN_LENGTH | font_GIVEN_BLOCK,
@@ -1120,8 +1160,10 @@ rufl_code rufl_init_scan_font_in_encoding(const char *font_name,
 		LOG("xfont_scan_string(\"%s\", U+%x, ...) (c=%x): 0x%x: %s",
 				buf, umap->map[i].u, umap->map[i].c,
 				rufl_fm_error->errnum, rufl_fm_error->errmess);
+		free(buf);
 		return rufl_FONT_MANAGER_ERROR;
 	}
+	free(buf);
 
 	if (encoding) {
 		umap->encoding = strdup(encoding);
@@ -1750,6 +1792,13 @@ rufl_code rufl_load_cache(void)
 				free(identifier);
 				break;
 			}
+			if (rufl_FONT_ID_ENCODINGS < num_umaps) {
+				LOG("\"%s\" has too many encodings",
+						identifier);
+				free(charset);
+				free(identifier);
+				break;
+			}
 
 			umap = calloc(num_umaps, sizeof *umap);
 			if (!umap) {
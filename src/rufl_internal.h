@@ -139,6 +139,14 @@ struct rufl_font_list_entry {
 	uint32_t weight;
 	/** Font slant (0 or 1). */
 	uint32_t slant;
+	/** Font Manager name of the font in each encoding (see
+	 * rufl_font_id_name()), or 0 until rufl_font_names_init(). */
+	const char **names;
+	/** Whether the font has kerning data. */
+	uint32_t kerning;
+#	define rufl_KERNING_UNKNOWN 0
+#	define rufl_KERNING_NONE 1
+#	define rufl_KERNING_PRESENT 2
 };
 /** List of all available fonts. */
 extern struct rufl_font_list_entry *rufl_font_list;
@@ -160,31 +168,40 @@ extern struct rufl_family_map_entry *rufl_family_map;
 /** No font contains this character. */
 #define NOT_AVAILABLE 0xffff
 
-/** Number of slots in recent-use cache. This is the maximum number of RISC OS
- * font handles that will be used at any time by the library. */
+/** Id of a font and encoding (index in rufl_font_list_entry umap, or 0
+ * for UTF8 with the UCS Font Manager). */
+#define rufl_FONT_ID(font, encoding) ((rufl_font_id) (font) << 8 | (encoding))
+/** Number of encodings which a font id can tell apart. Fonts are not used
+ * in more encodings than this, so that ids do not alias. */
+#define rufl_FONT_ID_ENCODINGS 256
+/** Id of the font used for rendering hex substitutions. */
+#define rufl_FONT_ID_CORPUS ((rufl_font_id) -1)
+
+/** Default number of font handles in the recent-use cache. This is the
+ * maximum number of RISC OS font handles that will be used at any time by
+ * the library, unless changed by rufl_set_handle_cache_size(). */
 #define rufl_CACHE_SIZE 10
+/** Number of font handles placed in the cache before the number kept open
+ * grows by one again, after the Font Manager ran out of handles. */
+#define rufl_CACHE_RECOVERY 64
+/** Number of output contexts (values of rufl_context). */
+#define rufl_CONTEXTS 3
+/** Current output context. */
+extern rufl_context rufl_output_context;
 
-/** An entry in rufl_cache. */
-struct rufl_cache_entry {
-	/** Font number (index in rufl_font_list), or rufl_CACHE_*. */
-	uint32_t font;
-	/** No font cached in this slot. */
+/** No font cached in this slot. */
 #define rufl_CACHE_NONE UINT_MAX
-	/** Font for rendering hex substitutions in this slot. */
+/** Font for rendering hex substitutions in this slot. */
 #define rufl_CACHE_CORPUS (UINT_MAX - 1)
-	/** Font size. */
-	uint32_t size;
-	/** Font encoding */
-	const char *encoding;
-	/** Value of rufl_cache_time when last used. */
-	uint32_t last_used;
-	/** RISC OS font handle. */
-	font_f f;
-};
-/** Cache of rufl_CACHE_SIZE most recently used font handles. */
-extern struct rufl_cache_entry rufl_cache[rufl_CACHE_SIZE];
-/** Counter for measuring age of cache entries. */
-extern uint32_t rufl_cache_time;
+
+/** Encodings passed to rufl_find_font() from more than one place. The font
+ * handle cache compares encodings by pointer, so use these rather than
+ * string literals. */
+extern const char rufl_encoding_utf8[];
+extern const char rufl_encoding_latin1[];
+
+/** Performance counters, reported by rufl_get_stats(). */
+extern struct rufl_stats rufl_stats;
 
 /** Font manager does not support Unicode. */
 extern bool rufl_old_font_manager;
@@ -192,18 +209,138 @@ extern bool rufl_old_font_manager;
 /** Font manager supports background blending */
 extern bool rufl_can_background_blend;
 
+/** Printable ASCII characters present in a font. */
+struct rufl_ascii_set {
+	/** Bitmap of U+0000 to U+007F, indexed as in struct
+	 * rufl_character_set. Only U+0020 to U+007E may be set. */
+	uint8_t bits[16];
+	/** All of U+0020 to U+007E are present. */
+	bool all;
+};
+
+/** A font family and style resolved to a font. */
+struct rufl_face {
+	/** Font (index in rufl_font_list). */
+	unsigned int font;
+	/** Style requires slanting by transform. */
+	unsigned int slant;
+	/** Character set of font. */
+	const struct rufl_character_set *charset;
+	/** Printable ASCII characters in font. */
+	struct rufl_ascii_set ascii;
+};
+
+/** Extra space added by rufl_process_run(), in OS units. */
+struct rufl_spacing {
+	/** Space added after every character. */
+	int letter;
+	/** Further space added after every space character. */
+	int word;
+};
+
+/** Operation performed on a string by rufl_process_layout(). rufl_BREAK
+ * is only for rufl_process_run(): it is rufl_SPLIT, but splitting at the
+ * last space which starts within click_x where there is one. */
+typedef enum { rufl_PAINT, rufl_WIDTH, rufl_X_TO_OFFSET,
+		rufl_SPLIT, rufl_PAINT_CALLBACK, rufl_PAINT_CALLBACK_ID,
+		rufl_FONT_BBOX, rufl_BREAK } rufl_action;
+
+/** A run of characters from a single font, part of struct rufl_layout. */
+struct rufl_layout_run {
+	/** Font number (index in rufl_font_list), or NOT_AVAILABLE. */
+	unsigned int font;
+	/** Number of characters in run. */
+	unsigned int n;
+	/** Index in rufl_layout s of first character in run. */
+	size_t start;
+};
+
+/** A string split into runs of characters from a single font. */
+struct rufl_layout {
+	/** Requested font (index in rufl_font_list). */
+	unsigned int font;
+	/** Slant to apply to requested font (0 or 1). */
+	unsigned int slant;
+	/** Font size. */
+	unsigned int font_size;
+	/** Characters in string, length + 1 entries, zero terminated. */
+	uint32_t *s;
+	/** Byte offset in string of each character, length + 1 entries. */
+	size_t *offset;
+	/** Number of characters in string. */
+	size_t length;
+	/** Runs of characters, in order. */
+	struct rufl_layout_run *run;
+	/** Number of entries in run. */
+	size_t runs;
+};
+
 rufl_code rufl_find_font_family(const char *family, rufl_style font_style,
 		unsigned int *font, unsigned int *slanted,
 		struct rufl_character_set **charset);
+rufl_code rufl_family_index_init(void);
+void rufl_family_index_free(void);
+rufl_code rufl_face_init(struct rufl_face *face,
+		const char *font_family, rufl_style font_style);
 rufl_code rufl_find_font(unsigned int font, unsigned int font_size,
 		const char *encoding, font_f *fhandle);
+rufl_code rufl_find_font_scaled(unsigned int font, unsigned int font_size,
+		const char *encoding, font_f *fhandle, int *scale);
+unsigned int rufl_shared_size(unsigned int font_size);
 bool rufl_character_set_test(const struct rufl_character_set *charset,
 		uint32_t u);
 
 rufl_code rufl_substitution_table_init(void);
 void rufl_substitution_table_fini(void);
 unsigned int rufl_substitution_table_lookup(uint32_t u);
+rufl_code rufl_substitution_table_lookup_run(uint32_t u, unsigned int *font,
+		uint32_t *run_end);
 void rufl_substitution_table_dump(void);
+void rufl_character_set_ascii(const struct rufl_character_set *charset,
+		struct rufl_ascii_set *ascii);
+size_t rufl_utf8_ascii_span(const struct rufl_ascii_set *ascii,
+		const uint8_t *s, size_t l);
+rufl_code rufl_layout_segment(struct rufl_layout *layout,
+		const struct rufl_character_set *charset,
+		const uint8_t *string, size_t length);
+rufl_code rufl_process_layout(rufl_action action,
+		const struct rufl_layout *layout,
+		int x, int y, unsigned int flags,
+		int *width, int click_x, size_t *char_offset, int *actual_x,
+		rufl_callback_t callback, void *context);
+rufl_code rufl_process_run(rufl_action action,
+		const uint32_t *s, unsigned int n,
+		unsigned int font, unsigned int font_size, unsigned int slant,
+		int *x, int y, unsigned int flags,
+		const struct rufl_spacing *spacing,
+		int click_x, size_t *offset,
+		rufl_callback_t callback, void *context);
+
+bool rufl_advance_cache_measure(unsigned int font, unsigned int font_size,
+		const uint32_t *s, unsigned int n, int *width);
+void rufl_advance_cache_flush(void);
+void rufl_advance_cache_flush_context(unsigned int context);
+void rufl_advance_cache_dump(void);
+rufl_code rufl_font_names_init(void);
+void rufl_font_names_free(void);
+const char *rufl_font_name(unsigned int font, const char *encoding);
+char *rufl_font_name_format(const char *identifier, const char *encoding);
+void rufl_resolve_cache_flush(void);
+void rufl_resolve_cache_dump(void);
+bool rufl_handle_cache_lookup(unsigned int font, unsigned int font_size,
+		const char *encoding, font_f *f);
+rufl_code rufl_handle_cache_insert(unsigned int font, unsigned int font_size,
+		const char *encoding, font_f f);
+bool rufl_handle_cache_pin(unsigned int font, unsigned int font_size,
+		const char *encoding);
+void rufl_handle_cache_unpin(unsigned int font, unsigned int font_size,
+		const char *encoding);
+bool rufl_handle_cache_reclaim(void);
+void rufl_handle_cache_flush(void);
+void rufl_handle_cache_fini(void);
+void rufl_handle_cache_resolution(int *xres, int *yres);
+void rufl_handle_cache_dump(void);
+void rufl_stats_dump(void);
 
 #define rufl_utf8_read(s, l, u)						       \
 	if (4 <= l && ((s[0] & 0xf8) == 0xf0) && ((s[1] & 0xc0) == 0x80) &&    \
@@ -10,19 +10,17 @@
 
 
 /**
- * Clear the internal font handle cache.
+ * Clear the internal font handle cache and glyph advances of the current
+ * output context. Other output contexts are not affected.
  *
- * Call this function on mode changes or output redirection changes.
+ * Call this function on mode changes, or when output is redirected without
+ * changing output context.
  */
 
 void rufl_invalidate_cache(void)
 {
-	unsigned int i;
+	rufl_handle_cache_flush();
 
-	for (i = 0; i != rufl_CACHE_SIZE; i++) {
-		if (rufl_cache[i].font != rufl_CACHE_NONE) {
-			xfont_lose_font(rufl_cache[i].f);
-			rufl_cache[i].font = rufl_CACHE_NONE;
-		}
-        }
+	/* glyph advances may depend on the output resolution */
+	rufl_advance_cache_flush_context(rufl_output_context);
 }
@@ -0,0 +1,140 @@
+/*
+ * This file is part of RUfl
+ * Licensed under the MIT License,
+ *                http://www.opensource.org/licenses/mit-license
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include "rufl_internal.h"
+
+
+/**
+ * Split Unicode text into runs of characters from a single font.
+ *
+ * The characters of the string are decoded and the font for each is found
+ * once, so that the text may then be painted, measured and hit-tested
+ * without repeating this work.
+ *
+ * \param  font_family  name of font family
+ * \param  font_style   font style
+ * \param  font_size    size of font in 16ths of a point
+ * \param  string       UTF-8 string
+ * \param  length       length of string in bytes
+ * \param  layout       updated to new layout
+ * \return  rufl_OK on success, or an error code
+ */
+
+rufl_code rufl_layout_create(const char *font_family, rufl_style font_style,
+		unsigned int font_size,
+		const char *string, size_t length,
+		rufl_layout **layout)
+{
+	struct rufl_character_set *charset;
+	struct rufl_layout *l;
+	rufl_code code;
+
+	assert(layout);
+
+	l = calloc(1, sizeof *l);
+	if (!l)
+		return rufl_OUT_OF_MEMORY;
+
+	code = rufl_find_font_family(font_family, font_style,
+			&l->font, &l->slant, &charset);
+	if (code != rufl_OK) {
+		free(l);
+		return code;
+	}
+	l->font_size = font_size;
+
+	code = rufl_layout_segment(l, charset,
+			(const uint8_t *) string, length);
+	if (code != rufl_OK) {
+		rufl_layout_destroy(l);
+		return code;
+	}
+
+	*layout = l;
+
+	return rufl_OK;
+}
+
+
+/**
+ * Render laid out text.
+ */
+
+rufl_code rufl_layout_paint(const rufl_layout *layout,
+		int x, int y, unsigned int flags)
+{
+	return rufl_process_layout(rufl_PAINT, layout,
+			x, y, flags, 0, 0, 0, 0, 0, 0);
+}
+
+
+/**
+ * Measure the width of laid out text.
+ */
+
+rufl_code rufl_layout_width(const rufl_layout *layout, int *width)
+{
+	return rufl_process_layout(rufl_WIDTH, layout,
+			0, 0, 0, width, 0, 0, 0, 0, 0);
+}
+
+
+/**
+ * Find where in laid out text a x coordinate falls.
+ */
+
+rufl_code rufl_layout_x_to_offset(const rufl_layout *layout,
+		int click_x,
+		size_t *char_offset, int *actual_x)
+{
+	return rufl_process_layout(rufl_X_TO_OFFSET, layout,
+			0, 0, 0, 0, click_x, char_offset, actual_x, 0, 0);
+}
+
+
+/**
+ * Find the prefix of laid out text that will fit in a specified width.
+ */
+
+rufl_code rufl_layout_split(const rufl_layout *layout,
+		int width,
+		size_t *char_offset, int *actual_x)
+{
+	return rufl_process_layout(rufl_SPLIT, layout,
+			0, 0, 0, 0, width, char_offset, actual_x, 0, 0);
+}
+
+
+/**
+ * Render laid out text, but call a callback instead of each call to
+ * Font_Paint.
+ */
+
+rufl_code rufl_layout_paint_callback(const rufl_layout *layout,
+		int x, int y,
+		rufl_callback_t callback, void *context)
+{
+	return rufl_process_layout(rufl_PAINT_CALLBACK, layout,
+			x, y, 0, 0, 0, 0, 0, callback, context);
+}
+
+
+/**
+ * Free a layout.
+ */
+
+void rufl_layout_destroy(rufl_layout *layout)
+{
+	if (!layout)
+		return;
+
+	free(layout->s);
+	free(layout->offset);
+	free(layout->run);
+	free(layout);
+}
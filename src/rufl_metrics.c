@@ -16,25 +16,43 @@
 static int rufl_unicode_map_search_cmp(const void *keyval, const void *datum);
 
 /**
- * Read a font's metrics (sized for a 1pt font)
+ * Read a font's metrics, sized for a 1pt font.
  */
+
 rufl_code rufl_font_metrics(const char *font_family, rufl_style font_style,
 		os_box *bbox, int32_t *xkern, int32_t *ykern, int32_t *italic,
 		int32_t *ascent, int32_t *descent,
 		int32_t *xheight, int32_t *cap_height,
 		int8_t *uline_position, uint8_t *uline_thickness)
 {
-	unsigned int font;
-	font_f f;
-	int misc_size;
-	font_metrics_misc_info *misc_info;
+	struct rufl_face face;
 	rufl_code code;
 
-	code = rufl_find_font_family(font_family, font_style, &font,
-			NULL, NULL);
+	code = rufl_face_init(&face, font_family, font_style);
 	if (code != rufl_OK)
 		return code;
 
+	return rufl_face_font_metrics(&face, bbox, xkern, ykern, italic,
+			ascent, descent, xheight, cap_height,
+			uline_position, uline_thickness);
+}
+
+/**
+ * Read a face's metrics, sized for a 1pt font.
+ */
+
+rufl_code rufl_face_font_metrics(const rufl_face *face,
+		os_box *bbox, int32_t *xkern, int32_t *ykern, int32_t *italic,
+		int32_t *ascent, int32_t *descent,
+		int32_t *xheight, int32_t *cap_height,
+		int8_t *uline_position, uint8_t *uline_thickness)
+{
+	unsigned int font = face->font;
+	font_f f;
+	int misc_size;
+	font_metrics_misc_info *misc_info;
+	rufl_code code;
+
 	code = rufl_find_font(font, 16 /* 1pt */, NULL, &f);
 	if (code != rufl_OK)
 		return code;
@@ -110,20 +128,44 @@ rufl_code rufl_font_metrics(const char *font_family, rufl_style font_style,
 }
 
 /**
- * Read a glyph's metrics
+ * Read a glyph's metrics.
  */
+
 rufl_code rufl_glyph_metrics(const char *font_family,
 		rufl_style font_style, unsigned int font_size,
 		const char *string, size_t length,
 		int32_t *x_bearing, int32_t *y_bearing,
 		int32_t *width, int32_t *height,
 		int32_t *x_advance, int32_t *y_advance)
+{
+	struct rufl_face face;
+	rufl_code code;
+
+	code = rufl_face_init(&face, font_family, font_style);
+	if (code != rufl_OK)
+		return code;
+
+	return rufl_face_glyph_metrics(&face, font_size, string, length,
+			x_bearing, y_bearing, width, height,
+			x_advance, y_advance);
+}
+
+/**
+ * Read the metrics of a glyph in a face.
+ */
+
+rufl_code rufl_face_glyph_metrics(const rufl_face *face,
+		unsigned int font_size,
+		const char *string, size_t length,
+		int32_t *x_bearing, int32_t *y_bearing,
+		int32_t *width, int32_t *height,
+		int32_t *x_advance, int32_t *y_advance)
 {
 	const uint8_t *ustring = (const uint8_t *) string;
 	const char *font_encoding = NULL;
-	unsigned int font, font1, u;
+	unsigned int font = face->font, font1, u;
 	uint32_t u1[2];
-	struct rufl_character_set *charset;
+	const struct rufl_character_set *charset = face->charset;
 	struct rufl_unicode_map_entry *umap_entry = NULL;
 	font_f f;
 	rufl_code code;
@@ -131,12 +173,6 @@ rufl_code rufl_glyph_metrics(const char *font_family,
 	font_string_flags flags;
 	int xa, ya;
 
-	/* Find font family containing glyph */
-	code = rufl_find_font_family(font_family, font_style,
-			&font, NULL, &charset);
-	if (code != rufl_OK)
-		return code;
-
 	rufl_utf8_read(ustring, length, u);
 	if (charset && rufl_character_set_test(charset, u))
 		font1 = font;
@@ -256,6 +292,7 @@ rufl_code rufl_glyph_metrics(const char *font_family,
 		s[0] = umap_entry->c;
 		s[1] = 0;
 
+		rufl_stats.font_scan_string++;
 		rufl_fm_error = xfont_scan_string(f, s, flags,
 				0x7fffffff, 0x7fffffff, &block, 0, 1,
 				0, &xa, &ya, 0);
@@ -267,6 +304,7 @@ rufl_code rufl_glyph_metrics(const char *font_family,
 		}
 	} else {
 		/* UCS Font Manager */
+		rufl_stats.font_scan_string++;
 		rufl_fm_error = xfont_scan_string(f, (const char *)u1,
 				flags | font_GIVEN32_BIT,
 				0x7fffffff, 0x7fffffff, &block, 0, 4,
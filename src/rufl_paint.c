@@ -14,10 +14,71 @@
 #include "rufl_internal.h"
 
 
-typedef enum { rufl_PAINT, rufl_WIDTH, rufl_X_TO_OFFSET,
-		rufl_SPLIT, rufl_PAINT_CALLBACK, rufl_FONT_BBOX } rufl_action;
+/** Number of characters that a span may hold without using the heap. */
 #define rufl_PROCESS_CHUNK 200
 
+/** Number of hex boxes that rufl_paint_hex_boxes() may build rows for
+ * without using the heap. */
+#define rufl_HEX_BOXES_CHUNK 16
+
+/** Characters of a run in a single font, and their byte offsets in the
+ * string. */
+struct rufl_span_buffer {
+	uint32_t *s;
+	size_t *offset;
+	/** Number of entries in s and offset. */
+	size_t size;
+	/** s and offset have been allocated on the heap. */
+	bool heap;
+};
+
+/** Number of slots in the character resolution cache. Must be a power of
+ * 2. */
+#define rufl_RESOLVE_CACHE_SIZE 1024
+
+/** An entry in the character resolution cache. */
+struct rufl_resolve_cache_entry {
+	/** Codepoint, requested font and generation (see rufl_RESOLVE_KEY). */
+	uint64_t key;
+	/** Font for codepoint (index in rufl_font_list), or NOT_AVAILABLE. */
+	unsigned int font;
+	/** Last codepoint of the range from the codepoint which resolves to
+	 * the same font from the substitution table. */
+	uint32_t run_end;
+};
+
+/** Key of a cache entry for a codepoint in a requested font. The
+ * codepoint takes 21 bits, the font 16 bits, and the generation the
+ * remaining 27. */
+#define rufl_RESOLVE_KEY(u, font) ((uint64_t) (u) |			\
+		((uint64_t) (font) << 21) |					\
+		((uint64_t) rufl_resolve_cache_generation << 37))
+#define rufl_RESOLVE_GENERATION_MAX (1u << 27)
+
+/** Direct-mapped cache of the font used for each character. */
+static struct rufl_resolve_cache_entry
+		rufl_resolve_cache[rufl_RESOLVE_CACHE_SIZE];
+/** Generation of the valid entries in rufl_resolve_cache. Never 0, so an
+ * empty slot never matches. */
+static uint32_t rufl_resolve_cache_generation = 1;
+
+/** Callback and context for rufl_PAINT_CALLBACK_ID, passed as the context
+ * argument of the rufl_process functions. */
+struct rufl_callback_id {
+	rufl_callback_id_t callback;
+	void *context;
+};
+
+/** Digit width last measured by rufl_paint_hex_boxes(). */
+static struct {
+	/** Corpus font handle, or 0 if nothing was measured. */
+	font_f f;
+	/** Font size the handle is for half of. */
+	unsigned int font_size;
+	/** Width of each digit in millipoints, or 0 if they differ. */
+	int digit_width;
+} rufl_hex_digits;
+
 bool rufl_can_background_blend = false;
 
 static const os_trfm trfm_oblique =
@@ -25,31 +86,67 @@ static const os_trfm trfm_oblique =
 
 
 static rufl_code rufl_process(rufl_action action,
+		const struct rufl_face *faces, unsigned int face_count,
 		const char *font_family, rufl_style font_style,
 		unsigned int font_size,
 		const uint8_t *string0, size_t length,
 		int x, int y, unsigned int flags,
+		const struct rufl_spacing *spacing,
 		int *width, int click_x, size_t *char_offset, int *actual_x,
 		rufl_callback_t callback, void *context);
+static rufl_code rufl_span_buffer_grow(struct rufl_span_buffer *span,
+		size_t used, size_t size);
+static rufl_code rufl_layout_extend(struct rufl_layout *layout,
+		size_t *runs_size, size_t n, unsigned int font);
+static rufl_code rufl_process_families(rufl_action action,
+		const char *const *font_families, unsigned int families,
+		rufl_style font_style, unsigned int font_size,
+		const char *string, size_t length,
+		int x, int y, unsigned int flags,
+		int *width, int click_x, size_t *char_offset, int *actual_x);
+static unsigned int rufl_process_resolve(uint32_t u, unsigned int font,
+		const struct rufl_character_set *charset, uint32_t *run_end);
+static unsigned int rufl_process_resolve_faces(uint32_t u,
+		const struct rufl_face *faces, unsigned int face_count,
+		unsigned int *slant, uint32_t *run_end);
+static inline void rufl_process_count(unsigned int font1, unsigned int font);
+static size_t rufl_process_extend_run(const uint8_t **string,
+		size_t *length, const uint8_t *string0, uint32_t u,
+		uint32_t run_end, unsigned int font1, unsigned int font,
+		uint32_t *s, size_t *offset);
 static rufl_code rufl_process_span(rufl_action action,
-		uint32_t *s, unsigned int n,
+		const uint32_t *s, unsigned int n,
 		unsigned int font, unsigned int font_size, unsigned int slant,
 		int *x, int y, unsigned int flags,
+		const struct rufl_spacing *spacing,
 		int click_x, size_t *offset,
 		rufl_callback_t callback, void *context);
 static rufl_code rufl_process_span_old(rufl_action action,
-		uint32_t *s, unsigned int n,
+		const uint32_t *s, unsigned int n,
 		unsigned int font, unsigned int font_size, unsigned int slant,
 		int *x, int y, unsigned int flags,
+		const struct rufl_spacing *spacing,
 		int click_x, size_t *offset,
 		rufl_callback_t callback, void *context);
 static int rufl_unicode_map_search_cmp(const void *keyval, const void *datum);
 static rufl_code rufl_process_not_available(rufl_action action,
-		uint32_t *s, unsigned int n,
+		const uint32_t *s, unsigned int n,
 		unsigned int font_size, int *x, int y,
-		unsigned int flags,
+		unsigned int flags, const struct rufl_spacing *spacing,
 		int click_x, size_t *offset,
 		rufl_callback_t callback, void *context);
+static rufl_code rufl_paint_hex_boxes(font_f f,
+		const uint32_t *s, unsigned int n,
+		unsigned int font_size, int *x, int y, unsigned int flags,
+		int letter, bool *painted);
+static void rufl_span_trfm(os_trfm *trfm, int scale, bool oblique);
+static int rufl_span_spacing(const struct rufl_spacing *spacing,
+		const uint32_t *s, unsigned int n, font_paint_block *paint,
+		font_scan_block *scan);
+static void rufl_callback_id_call(void *context,
+		rufl_font_id font_id, unsigned int font_size,
+		const uint8_t *s8, const uint32_t *s32, unsigned int n,
+		int x, int y);
 
 
 /**
@@ -61,10 +158,10 @@ rufl_code rufl_paint(const char *font_family, rufl_style font_style,
 		const char *string, size_t length,
 		int x, int y, unsigned int flags)
 {
-	return rufl_process(rufl_PAINT,
+	return rufl_process(rufl_PAINT, 0, 0,
 			font_family, font_style, font_size,
 			(const uint8_t *) string, length,
-			x, y, flags, 0, 0, 0, 0, 0, 0);
+			x, y, flags, 0, 0, 0, 0, 0, 0, 0);
 }
 
 
@@ -77,10 +174,10 @@ rufl_code rufl_width(const char *font_family, rufl_style font_style,
 		const char *string, size_t length,
 		int *width)
 {
-	return rufl_process(rufl_WIDTH,
+	return rufl_process(rufl_WIDTH, 0, 0,
 			font_family, font_style, font_size,
 			(const uint8_t *) string, length,
-			0, 0, 0, width, 0, 0, 0, 0, 0);
+			0, 0, 0, 0, width, 0, 0, 0, 0, 0);
 }
 
 
@@ -95,10 +192,10 @@ rufl_code rufl_x_to_offset(const char *font_family, rufl_style font_style,
 		int click_x,
 		size_t *char_offset, int *actual_x)
 {
-	return rufl_process(rufl_X_TO_OFFSET,
+	return rufl_process(rufl_X_TO_OFFSET, 0, 0,
 			font_family, font_style, font_size,
 			(const uint8_t *) string, length,
-			0, 0, 0, 0, click_x, char_offset, actual_x, 0, 0);
+			0, 0, 0, 0, 0, click_x, char_offset, actual_x, 0, 0);
 }
 
 
@@ -112,10 +209,10 @@ rufl_code rufl_split(const char *font_family, rufl_style font_style,
 		int width,
 		size_t *char_offset, int *actual_x)
 {
-	return rufl_process(rufl_SPLIT,
+	return rufl_process(rufl_SPLIT, 0, 0,
 			font_family, font_style, font_size,
 			(const uint8_t *) string, length,
-			0, 0, 0, 0, width, char_offset, actual_x, 0, 0);
+			0, 0, 0, 0, 0, width, char_offset, actual_x, 0, 0);
 }
 
 
@@ -129,10 +226,119 @@ rufl_code rufl_paint_callback(const char *font_family, rufl_style font_style,
 		int x, int y,
 		rufl_callback_t callback, void *context)
 {
-	return rufl_process(rufl_PAINT_CALLBACK,
+	return rufl_process(rufl_PAINT_CALLBACK, 0, 0,
+			font_family, font_style, font_size,
+			(const uint8_t *) string, length,
+			x, y, 0, 0, 0, 0, 0, 0, callback, context);
+}
+
+
+/**
+ * Render text, but call a callback instead of each call to Font_Paint,
+ * identifying fonts by id rather than by name.
+ */
+
+rufl_code rufl_paint_callback_id(const char *font_family,
+		rufl_style font_style, unsigned int font_size,
+		const char *string, size_t length,
+		int x, int y,
+		rufl_callback_id_t callback, void *context)
+{
+	struct rufl_callback_id id_callback = { callback, context };
+
+	return rufl_process(rufl_PAINT_CALLBACK_ID, 0, 0,
+			font_family, font_style, font_size,
+			(const uint8_t *) string, length,
+			x, y, 0, 0, 0, 0, 0, 0, 0, &id_callback);
+}
+
+
+/**
+ * Render Unicode text with extra space between letters and words.
+ */
+
+rufl_code rufl_paint_spaced(const char *font_family, rufl_style font_style,
+		unsigned int font_size,
+		const char *string, size_t length,
+		int x, int y, unsigned int flags,
+		int letter_spacing, int word_spacing)
+{
+	struct rufl_spacing spacing = { letter_spacing, word_spacing };
+
+	return rufl_process(rufl_PAINT, 0, 0,
+			font_family, font_style, font_size,
+			(const uint8_t *) string, length,
+			x, y, flags,
+			letter_spacing || word_spacing ? &spacing : 0,
+			0, 0, 0, 0, 0, 0);
+}
+
+
+/**
+ * Measure the width of Unicode text with extra space between letters and
+ * words.
+ */
+
+rufl_code rufl_width_spaced(const char *font_family, rufl_style font_style,
+		unsigned int font_size,
+		const char *string, size_t length,
+		int letter_spacing, int word_spacing,
+		int *width)
+{
+	struct rufl_spacing spacing = { letter_spacing, word_spacing };
+
+	return rufl_process(rufl_WIDTH, 0, 0,
 			font_family, font_style, font_size,
 			(const uint8_t *) string, length,
-			x, y, 0, 0, 0, 0, 0, callback, context);
+			0, 0, 0,
+			letter_spacing || word_spacing ? &spacing : 0,
+			width, 0, 0, 0, 0, 0);
+}
+
+
+/**
+ * Find the nearest character boundary in a string to where an x coordinate
+ * falls, with extra space between letters and words.
+ */
+
+rufl_code rufl_x_to_offset_spaced(const char *font_family,
+		rufl_style font_style, unsigned int font_size,
+		const char *string, size_t length,
+		int letter_spacing, int word_spacing,
+		int click_x,
+		size_t *char_offset, int *actual_x)
+{
+	struct rufl_spacing spacing = { letter_spacing, word_spacing };
+
+	return rufl_process(rufl_X_TO_OFFSET, 0, 0,
+			font_family, font_style, font_size,
+			(const uint8_t *) string, length,
+			0, 0, 0,
+			letter_spacing || word_spacing ? &spacing : 0,
+			0, click_x, char_offset, actual_x, 0, 0);
+}
+
+
+/**
+ * Find the prefix of a string that will fit in a specified width, with
+ * extra space between letters and words.
+ */
+
+rufl_code rufl_split_spaced(const char *font_family, rufl_style font_style,
+		unsigned int font_size,
+		const char *string, size_t length,
+		int letter_spacing, int word_spacing,
+		int width,
+		size_t *char_offset, int *actual_x)
+{
+	struct rufl_spacing spacing = { letter_spacing, word_spacing };
+
+	return rufl_process(rufl_SPLIT, 0, 0,
+			font_family, font_style, font_size,
+			(const uint8_t *) string, length,
+			0, 0, 0,
+			letter_spacing || word_spacing ? &spacing : 0,
+			0, width, char_offset, actual_x, 0, 0);
 }
 
 
@@ -144,35 +350,243 @@ rufl_code rufl_font_bbox(const char *font_family, rufl_style font_style,
 		unsigned int font_size,
 		os_box *bbox)
 {
-	return rufl_process(rufl_FONT_BBOX,
+	return rufl_process(rufl_FONT_BBOX, 0, 0,
 			font_family, font_style, font_size, 0,
-			0, 0, 0, 0, (int *) bbox, 0, 0, 0, 0, 0);
+			0, 0, 0, 0, 0, (int *) bbox, 0, 0, 0, 0, 0);
 }
 
 
 /**
- * Render, measure, or split Unicode text.
+ * Render Unicode text in a face.
+ */
+
+rufl_code rufl_face_paint(const rufl_face *face, unsigned int font_size,
+		const char *string, size_t length,
+		int x, int y, unsigned int flags)
+{
+	return rufl_process(rufl_PAINT, face, 1, 0, 0, font_size,
+			(const uint8_t *) string, length,
+			x, y, flags, 0, 0, 0, 0, 0, 0, 0);
+}
+
+
+/**
+ * Measure the width of Unicode text in a face.
+ */
+
+rufl_code rufl_face_width(const rufl_face *face, unsigned int font_size,
+		const char *string, size_t length,
+		int *width)
+{
+	return rufl_process(rufl_WIDTH, face, 1, 0, 0, font_size,
+			(const uint8_t *) string, length,
+			0, 0, 0, 0, width, 0, 0, 0, 0, 0);
+}
+
+
+/**
+ * Find the nearest character boundary in a string to where an x coordinate
+ * falls, for text in a face.
  */
 
+rufl_code rufl_face_x_to_offset(const rufl_face *face,
+		unsigned int font_size,
+		const char *string, size_t length,
+		int click_x,
+		size_t *char_offset, int *actual_x)
+{
+	return rufl_process(rufl_X_TO_OFFSET, face, 1, 0, 0, font_size,
+			(const uint8_t *) string, length,
+			0, 0, 0, 0, 0, click_x, char_offset, actual_x, 0, 0);
+}
+
+
+/**
+ * Find the prefix of a string that will fit in a specified width, for text
+ * in a face.
+ */
+
+rufl_code rufl_face_split(const rufl_face *face, unsigned int font_size,
+		const char *string, size_t length,
+		int width,
+		size_t *char_offset, int *actual_x)
+{
+	return rufl_process(rufl_SPLIT, face, 1, 0, 0, font_size,
+			(const uint8_t *) string, length,
+			0, 0, 0, 0, 0, width, char_offset, actual_x, 0, 0);
+}
+
+
+/**
+ * Render text in a face, but call a callback instead of each call to
+ * Font_Paint.
+ */
+
+rufl_code rufl_face_paint_callback(const rufl_face *face,
+		unsigned int font_size,
+		const char *string, size_t length,
+		int x, int y,
+		rufl_callback_t callback, void *context)
+{
+	return rufl_process(rufl_PAINT_CALLBACK, face, 1, 0, 0, font_size,
+			(const uint8_t *) string, length,
+			x, y, 0, 0, 0, 0, 0, 0, callback, context);
+}
+
+
+/**
+ * Determine the maximum bounding box of a face.
+ */
+
+rufl_code rufl_face_font_bbox(const rufl_face *face, unsigned int font_size,
+		os_box *bbox)
+{
+	return rufl_process(rufl_FONT_BBOX, face, 1, 0, 0, font_size, 0,
+			0, 0, 0, 0, 0, (int *) bbox, 0, 0, 0, 0, 0);
+}
+
+
+/**
+ * Render Unicode text in the first of a list of font families which has
+ * each character.
+ */
+
+rufl_code rufl_paint_families(const char *const *font_families,
+		unsigned int families, rufl_style font_style,
+		unsigned int font_size,
+		const char *string, size_t length,
+		int x, int y, unsigned int flags)
+{
+	return rufl_process_families(rufl_PAINT, font_families, families,
+			font_style, font_size, string, length,
+			x, y, flags, 0, 0, 0, 0);
+}
+
+
+/**
+ * Measure the width of Unicode text in a list of font families.
+ */
+
+rufl_code rufl_width_families(const char *const *font_families,
+		unsigned int families, rufl_style font_style,
+		unsigned int font_size,
+		const char *string, size_t length,
+		int *width)
+{
+	return rufl_process_families(rufl_WIDTH, font_families, families,
+			font_style, font_size, string, length,
+			0, 0, 0, width, 0, 0, 0);
+}
+
+
+/**
+ * Find the nearest character boundary in a string to where an x coordinate
+ * falls, for text in a list of font families.
+ */
+
+rufl_code rufl_x_to_offset_families(const char *const *font_families,
+		unsigned int families, rufl_style font_style,
+		unsigned int font_size,
+		const char *string, size_t length,
+		int click_x,
+		size_t *char_offset, int *actual_x)
+{
+	return rufl_process_families(rufl_X_TO_OFFSET, font_families,
+			families, font_style, font_size, string, length,
+			0, 0, 0, 0, click_x, char_offset, actual_x);
+}
+
+
+/**
+ * Find the prefix of a string that will fit in a specified width, for text
+ * in a list of font families.
+ */
+
+rufl_code rufl_split_families(const char *const *font_families,
+		unsigned int families, rufl_style font_style,
+		unsigned int font_size,
+		const char *string, size_t length,
+		int width,
+		size_t *char_offset, int *actual_x)
+{
+	return rufl_process_families(rufl_SPLIT, font_families, families,
+			font_style, font_size, string, length,
+			0, 0, 0, 0, width, char_offset, actual_x);
+}
+
+
+/**
+ * Resolve a list of font families to faces, and process text in them.
+ *
+ * Families which are not available are skipped, and only the first
+ * rufl_FAMILIES_MAX are used.
+ */
+
+rufl_code rufl_process_families(rufl_action action,
+		const char *const *font_families, unsigned int families,
+		rufl_style font_style, unsigned int font_size,
+		const char *string, size_t length,
+		int x, int y, unsigned int flags,
+		int *width, int click_x, size_t *char_offset, int *actual_x)
+{
+	struct rufl_face faces[rufl_FAMILIES_MAX];
+	unsigned int face_count = 0;
+	unsigned int i;
+
+	for (i = 0; i != families && face_count != rufl_FAMILIES_MAX; i++)
+		if (rufl_face_init(&faces[face_count], font_families[i],
+				font_style) == rufl_OK)
+			face_count++;
+	if (face_count == 0)
+		return rufl_FONT_NOT_FOUND;
+
+	return rufl_process(action, faces, face_count, 0, 0, font_size,
+			(const uint8_t *) string, length,
+			x, y, flags, 0, width, click_x, char_offset, actual_x,
+			0, 0);
+}
+
+
+/**
+ * Render, measure, or split Unicode text.
+ *
+ * Each character is taken from the first face which has it, or else from
+ * the font given by the substitution table.
+ *
+ * \param  faces        resolved font families and style, in order of
+ *                      preference, or 0 to use font_family and font_style
+ * \param  face_count   number of faces
+ * \param  font_family  name of font family, if faces is 0
+ * \param  font_style   font style, if faces is 0
+ * \param  spacing      extra spacing, or 0 for none
+ */
 rufl_code rufl_process(rufl_action action,
+		const struct rufl_face *faces, unsigned int face_count,
 		const char *font_family, rufl_style font_style,
 		unsigned int font_size,
 		const uint8_t *string0, size_t length,
 		int x, int y, unsigned int flags,
+		const struct rufl_spacing *spacing,
 		int *width, int click_x, size_t *char_offset, int *actual_x,
 		rufl_callback_t callback, void *context)
 {
-	uint32_t s[rufl_PROCESS_CHUNK];
+	uint32_t s_stack[rufl_PROCESS_CHUNK];
+	size_t offset_stack[rufl_PROCESS_CHUNK];
+	struct rufl_span_buffer span = { s_stack, offset_stack,
+			rufl_PROCESS_CHUNK, false };
+	struct rufl_face family_face;
 	unsigned int font;
-	unsigned int font0, font1;
-	unsigned int n;
+	unsigned int font0 = NOT_AVAILABLE, font1;
+	unsigned int slant0 = 0, slant1;
+	size_t n;
 	unsigned int u;
-	size_t offset;
-	size_t offset_u;
-	size_t offset_map[rufl_PROCESS_CHUNK];
+	uint32_t run_end;
+	size_t i, k;
+	size_t offset = 0;
+	size_t length1;
 	unsigned int slant;
-	const uint8_t *string = string0;
-	struct rufl_character_set *charset;
+	const uint8_t *string = string0, *string1;
+	const struct rufl_ascii_set *ascii;
 	rufl_code code;
 
 	assert(action == rufl_PAINT ||
@@ -182,6 +596,7 @@ rufl_code rufl_process(rufl_action action,
 			(action == rufl_SPLIT && char_offset &&
 					actual_x) ||
 			(action == rufl_PAINT_CALLBACK && callback) ||
+			(action == rufl_PAINT_CALLBACK_ID && context) ||
 			(action == rufl_FONT_BBOX && width));
 
 	if ((flags & rufl_BLEND_FONT) && !rufl_can_background_blend) {
@@ -205,85 +620,340 @@ rufl_code rufl_process(rufl_action action,
 		return rufl_OK;
 	}
 
-	code = rufl_find_font_family(font_family, font_style,
-			&font, &slant, &charset);
-	if (code != rufl_OK)
-		return code;
+	if (!faces) {
+		code = rufl_face_init(&family_face, font_family, font_style);
+		if (code != rufl_OK)
+			return code;
+		faces = &family_face;
+		face_count = 1;
+	}
+	font = faces[0].font;
+	slant = faces[0].slant;
+	ascii = &faces[0].ascii;
 
 	if (action == rufl_FONT_BBOX) {
 		if (rufl_old_font_manager)
 			code = rufl_process_span_old(action, 0, 0, font,
-					font_size, slant, width, 0, 0,
+					font_size, slant, width, 0, 0, 0,
 					0, 0, 0, 0);
 		else
 			code = rufl_process_span(action, 0, 0, font,
-					font_size, slant, width, 0, 0,
+					font_size, slant, width, 0, 0, 0,
 					0, 0, 0, 0);
 		return code;
 	}
 
-	offset_u = 0;
-	rufl_utf8_read(string, length, u);
-	if (u <= 0x001f || (0x007f <= u && u <= 0x009f))
-		font1 = NOT_AVAILABLE;
-	else if (charset && rufl_character_set_test(charset, u))
-		font1 = font;
-	else
-		font1 = rufl_substitution_table_lookup(u);
-	do {
-		s[0] = u;
-		offset_map[0] = offset_u;
-		n = 1;
-		font0 = font1;
-		/* invariant: s[0..n) is in font font0 */
-		while (0 < length && n < rufl_PROCESS_CHUNK && font1 == font0) {
-			offset_u = string - string0;
-			rufl_utf8_read(string, length, u);
-			s[n] = u;
-			offset_map[n] = offset_u;
-			if (u <= 0x001f || (0x007f <= u && u <= 0x009f))
-				font1 = NOT_AVAILABLE;
-			else if (charset && rufl_character_set_test(charset, u))
-				font1 = font;
-			else
-				font1 = rufl_substitution_table_lookup(u);
-			if (font1 == font0)
-				n++;
+	/* the offset read at the end is always stored when a span is
+	 * processed, but store it for the empty span as well */
+	span.offset[0] = 0;
+
+	while (length != 0) {
+		/* collect the run of characters in font font0 into
+		 * span.s[0..n) */
+		n = 0;
+		while (length != 0) {
+			if ((n == 0 || font0 == font) &&
+					(k = rufl_utf8_ascii_span(ascii,
+					string, length))) {
+				/* printable ASCII in requested font */
+				code = rufl_span_buffer_grow(&span, n, n + k);
+				if (code != rufl_OK)
+					goto out;
+				for (i = 0; i != k; i++) {
+					span.s[n] = string[i];
+					span.offset[n++] = string - string0 + i;
+				}
+				font0 = font;
+				slant0 = slant;
+				string += k;
+				length -= k;
+				rufl_stats.code_points_font += k;
+				continue;
+			}
+
+			string1 = string;
+			length1 = length;
+			rufl_utf8_read(string1, length1, u);
+			font1 = rufl_process_resolve_faces(u, faces, face_count,
+					&slant1, &run_end);
+			if (n != 0 && (font1 != font0 || slant1 != slant0))
+				break;
+
+			code = rufl_span_buffer_grow(&span, n, n + 1);
+			if (code != rufl_OK)
+				goto out;
+			span.s[n] = u;
+			span.offset[n++] = string - string0;
+			rufl_process_count(font1, font);
+			font0 = font1;
+			slant0 = slant1;
+			string = string1;
+			length = length1;
+
+			if (run_end != u) {
+				code = rufl_span_buffer_grow(&span, n,
+						n + (run_end - u));
+				if (code != rufl_OK)
+					goto out;
+				n += rufl_process_extend_run(&string, &length,
+						string0, u, run_end, font1,
+						font, span.s + n,
+						span.offset + n);
+			}
 		}
-		if (n == rufl_PROCESS_CHUNK)
-			n--;
-		s[n] = 0;
-		offset_map[n] = offset_u;
-		if (length == 0 && font1 == font0)
-			offset_map[n] = string - string0;
 
-		offset = n;
-		if (font0 == NOT_AVAILABLE)
-			code = rufl_process_not_available(action, s, n,
-					font_size, &x, y, flags,
-					click_x, &offset, callback, context);
-		else if (rufl_old_font_manager)
-			code = rufl_process_span_old(action, s, n, font0,
-					font_size, slant, &x, y, flags,
-					click_x, &offset, callback, context);
-		else
-			code = rufl_process_span(action, s, n, font0,
-					font_size, slant, &x, y, flags,
-					click_x, &offset, callback, context);
+		code = rufl_span_buffer_grow(&span, n, n + 1);
+		if (code != rufl_OK)
+			goto out;
+		span.s[n] = 0;
+		span.offset[n] = string - string0;
 
+		offset = n;
+		code = rufl_process_run(action, span.s, n, font0,
+				font_size, slant0, &x, y, flags, spacing,
+				click_x, &offset, callback, context);
 		if (code != rufl_OK)
-			return code;
+			goto out;
 
 		if ((action == rufl_X_TO_OFFSET || action == rufl_SPLIT) &&
 				(offset < n || click_x < x))
 			break;
+	}
+
+	if (action == rufl_WIDTH)
+		*width = x;
+	else if (action == rufl_X_TO_OFFSET || action == rufl_SPLIT) {
+		*char_offset = span.offset[offset];
+		*actual_x = x;
+	}
+
+out:
+	if (span.heap) {
+		free(span.s);
+		free(span.offset);
+	}
+
+	return code;
+}
+
+
+/**
+ * Ensure that a span buffer has space for a number of characters.
+ *
+ * The buffer initially points to arrays on the stack. When these are too
+ * small, the contents are moved to arrays on the heap, which then grow as
+ * required, and must be freed by the caller.
+ *
+ * \param  span  span buffer
+ * \param  used  number of characters in the buffer
+ * \param  size  number of characters required
+ * \return  rufl_OK on success, or rufl_OUT_OF_MEMORY
+ */
+
+rufl_code rufl_span_buffer_grow(struct rufl_span_buffer *span,
+		size_t used, size_t size)
+{
+	uint32_t *s;
+	size_t *offset;
+
+	if (size <= span->size)
+		return rufl_OK;
+
+	if (size < 2 * span->size)
+		size = 2 * span->size;
+
+	s = malloc(size * sizeof s[0]);
+	offset = malloc(size * sizeof offset[0]);
+	if (!s || !offset) {
+		free(s);
+		free(offset);
+		return rufl_OUT_OF_MEMORY;
+	}
+	memcpy(s, span->s, used * sizeof s[0]);
+	memcpy(offset, span->offset, used * sizeof offset[0]);
+
+	if (span->heap) {
+		free(span->s);
+		free(span->offset);
+	}
+	span->s = s;
+	span->offset = offset;
+	span->size = size;
+	span->heap = true;
+
+	return rufl_OK;
+}
+
+
+/**
+ * Split a string into runs of characters from a single font.
+ *
+ * \param  layout   layout to fill in, with font, slant and font_size set
+ * \param  charset  character set of the requested font
+ * \param  string   UTF-8 string
+ * \param  length   length of string in bytes
+ * \return  rufl_OK on success, or rufl_OUT_OF_MEMORY
+ */
+
+rufl_code rufl_layout_segment(struct rufl_layout *layout,
+		const struct rufl_character_set *charset,
+		const uint8_t *string, size_t length)
+{
+	const uint8_t *string0 = string;
+	struct rufl_ascii_set ascii;
+	size_t runs_size = 8;
+	size_t n = 0;
+	size_t i, k;
+	unsigned int u;
+	uint32_t run_end;
+	unsigned int font1;
+	rufl_code code;
+
+	layout->s = malloc((length + 1) * sizeof layout->s[0]);
+	layout->offset = malloc((length + 1) * sizeof layout->offset[0]);
+	layout->run = malloc(runs_size * sizeof layout->run[0]);
+	layout->runs = 0;
+	if (!layout->s || !layout->offset || !layout->run)
+		return rufl_OUT_OF_MEMORY;
+
+	rufl_character_set_ascii(charset, &ascii);
+
+	while (length != 0) {
+		/* run of printable ASCII in requested font */
+		k = rufl_utf8_ascii_span(&ascii, string, length);
+		rufl_stats.code_points_font += k;
+		for (i = 0; i != k; i++) {
+			code = rufl_layout_extend(layout, &runs_size, n,
+					layout->font);
+			if (code != rufl_OK)
+				return code;
+			layout->offset[n] = string - string0 + i;
+			layout->s[n++] = string[i];
+		}
+		string += k;
+		length -= k;
+		if (length == 0)
+			break;
+
+		layout->offset[n] = string - string0;
+		rufl_utf8_read(string, length, u);
+		font1 = rufl_process_resolve(u, layout->font, charset,
+				&run_end);
+		code = rufl_layout_extend(layout, &runs_size, n, font1);
+		if (code != rufl_OK)
+			return code;
+		rufl_process_count(font1, layout->font);
+		layout->s[n++] = u;
+
+		/* the run ends with font1, so extending it needs no new
+		 * run */
+		k = rufl_process_extend_run(&string, &length, string0, u,
+				run_end, font1, layout->font, layout->s + n,
+				layout->offset + n);
+		layout->run[layout->runs - 1].n += k;
+		n += k;
+	}
+	layout->offset[n] = string - string0;
+	layout->s[n] = 0;
+	layout->length = n;
+
+	return rufl_OK;
+}
+
+
+/**
+ * Add a character to the last run of a layout, or start a new run.
+ *
+ * \param  layout     layout being built
+ * \param  runs_size  size of run array, updated if it is grown
+ * \param  n          index of character in layout
+ * \param  font       font for character (index in rufl_font_list), or
+ *                    NOT_AVAILABLE
+ * \return  rufl_OK on success, or rufl_OUT_OF_MEMORY
+ */
+
+rufl_code rufl_layout_extend(struct rufl_layout *layout, size_t *runs_size,
+		size_t n, unsigned int font)
+{
+	struct rufl_layout_run *runs;
+
+	/* start a new run if the font changes */
+	if (layout->runs == 0 ||
+			layout->run[layout->runs - 1].font != font) {
+		if (layout->runs == *runs_size) {
+			runs = realloc(layout->run, 2 * *runs_size *
+					sizeof layout->run[0]);
+			if (!runs)
+				return rufl_OUT_OF_MEMORY;
+			layout->run = runs;
+			*runs_size *= 2;
+		}
+		layout->run[layout->runs].font = font;
+		layout->run[layout->runs].start = n;
+		layout->run[layout->runs].n = 0;
+		layout->runs++;
+	}
+	layout->run[layout->runs - 1].n++;
+
+	return rufl_OK;
+}
+
+
+/**
+ * Render, measure, or split a string which has been split into runs.
+ */
+
+rufl_code rufl_process_layout(rufl_action action,
+		const struct rufl_layout *layout,
+		int x, int y, unsigned int flags,
+		int *width, int click_x, size_t *char_offset, int *actual_x,
+		rufl_callback_t callback, void *context)
+{
+	const struct rufl_layout_run *run = layout->run;
+	size_t offset = layout->length;
+	size_t i;
+	rufl_code code;
 
-	} while (!(length == 0 && font1 == font0));
+	assert(action == rufl_PAINT ||
+			(action == rufl_WIDTH && width) ||
+			(action == rufl_X_TO_OFFSET && char_offset &&
+					actual_x) ||
+			(action == rufl_SPLIT && char_offset &&
+					actual_x) ||
+			(action == rufl_PAINT_CALLBACK && callback));
+
+	if ((flags & rufl_BLEND_FONT) && !rufl_can_background_blend) {
+		/* unsuitable FM => clear blending bit */
+		flags &= ~rufl_BLEND_FONT;
+	}
+
+	if ((action == rufl_X_TO_OFFSET || action == rufl_SPLIT) &&
+			click_x <= 0) {
+		*char_offset = 0;
+		*actual_x = 0;
+		return rufl_OK;
+	}
+
+	for (i = 0; i != layout->runs; i++, run++) {
+		offset = run->n;
+		code = rufl_process_run(action, layout->s + run->start,
+				run->n, run->font,
+				layout->font_size, layout->slant, &x, y, flags,
+				0, click_x, &offset, callback, context);
+		if (code != rufl_OK)
+			return code;
+
+		offset += run->start;
+
+		if ((action == rufl_X_TO_OFFSET || action == rufl_SPLIT) &&
+				(offset < run->start + run->n || click_x < x))
+			break;
+	}
 
 	if (action == rufl_WIDTH)
 		*width = x;
 	else if (action == rufl_X_TO_OFFSET || action == rufl_SPLIT) {
-		*char_offset = offset_map[offset];
+		*char_offset = layout->offset[offset];
 		*actual_x = x;
 	}
 
@@ -291,31 +961,294 @@ rufl_code rufl_process(rufl_action action,
 }
 
 
+/**
+ * Find the font to use for a character.
+ *
+ * When the character is substituted, the following characters up to
+ * run_end are missing from the requested font and are substituted by the
+ * same font, so they need not be resolved.
+ *
+ * \param  u        Unicode codepoint
+ * \param  font     requested font (index in rufl_font_list)
+ * \param  charset  character set of requested font
+ * \param  run_end  updated to last codepoint of the range from u which
+ *                  resolves to the same font from the substitution table,
+ *                  or u
+ * \return  index in rufl_font_list, or NOT_AVAILABLE
+ */
+
+unsigned int rufl_process_resolve(uint32_t u, unsigned int font,
+		const struct rufl_character_set *charset, uint32_t *run_end)
+{
+	struct rufl_resolve_cache_entry *entry;
+	uint64_t key;
+	uint32_t end;
+
+	*run_end = u;
+
+	if (u <= 0x001f || (0x007f <= u && u <= 0x009f))
+		return NOT_AVAILABLE;
+
+	key = rufl_RESOLVE_KEY(u, font);
+	entry = &rufl_resolve_cache[(u ^ (font * 0x9e3779b1u)) &
+			(rufl_RESOLVE_CACHE_SIZE - 1)];
+	if (entry->key == key) {
+		rufl_stats.resolve_cache_hits++;
+		*run_end = entry->run_end;
+		return entry->font;
+	}
+	rufl_stats.resolve_cache_misses++;
+
+	entry->key = key;
+	entry->run_end = u;
+	if (charset && rufl_character_set_test(charset, u)) {
+		entry->font = font;
+	} else {
+		if (rufl_substitution_table_lookup_run(u, &entry->font,
+				&end) != rufl_OK) {
+			/* not cached, so that the lookup is retried */
+			entry->key = 0;
+			return NOT_AVAILABLE;
+		}
+		/* stop at the controls or a character in the requested font */
+		while (entry->run_end != end && entry->run_end + 1 != 0x007f &&
+				!(charset && rufl_character_set_test(charset,
+						entry->run_end + 1)))
+			entry->run_end++;
+	}
+
+	*run_end = entry->run_end;
+
+	return entry->font;
+}
+
+
+/**
+ * Find the font to use for a character, trying a list of faces in order
+ * before the substitution table.
+ *
+ * \param  u           Unicode codepoint
+ * \param  faces       faces in order of preference
+ * \param  face_count  number of faces
+ * \param  slant       updated to slant to apply to the font
+ * \param  run_end     updated to last codepoint of the range from u which
+ *                     resolves to the same font, see rufl_process_resolve(),
+ *                     or u if there is more than one face
+ * \return  font number, or NOT_AVAILABLE
+ */
+
+unsigned int rufl_process_resolve_faces(uint32_t u,
+		const struct rufl_face *faces, unsigned int face_count,
+		unsigned int *slant, uint32_t *run_end)
+{
+	unsigned int font1;
+	unsigned int i;
+
+	*slant = faces[0].slant;
+	font1 = rufl_process_resolve(u, faces[0].font, faces[0].charset,
+			run_end);
+	if (font1 == faces[0].font || face_count == 1 ||
+			u <= 0x001f || (0x007f <= u && u <= 0x009f))
+		return font1;
+
+	/* checking the range against the other faces on every call would
+	 * cost more than resolving each character, so there is no range */
+	*run_end = u;
+
+	for (i = 1; i != face_count; i++) {
+		if (faces[i].charset && rufl_character_set_test(
+				faces[i].charset, u)) {
+			*slant = faces[i].slant;
+			return faces[i].font;
+		}
+	}
+
+	return font1;
+}
+
+
+/**
+ * Count a character in the performance counters.
+ *
+ * \param  font1  font used for the character, from rufl_process_resolve()
+ * \param  font   requested font
+ */
+
+static inline void rufl_process_count(unsigned int font1, unsigned int font)
+{
+	if (font1 == font)
+		rufl_stats.code_points_font++;
+	else if (font1 == NOT_AVAILABLE)
+		rufl_stats.code_points_not_available++;
+	else
+		rufl_stats.code_points_substituted++;
+}
+
+
+/**
+ * Take the characters following a substituted character which are in its
+ * range, so that they need not be resolved.
+ *
+ * \param  string   pointer to rest of string, updated past the characters
+ * \param  length   length of rest of string, updated
+ * \param  string0  start of string, for offsets
+ * \param  u        substituted character
+ * \param  run_end  end of range of u, from rufl_process_resolve()
+ * \param  font1    font used for u
+ * \param  font     requested font
+ * \param  s        updated with the characters, space for run_end - u
+ * \param  offset   updated with offset in string of each character
+ * \return  number of characters taken
+ */
+
+size_t rufl_process_extend_run(const uint8_t **string, size_t *length,
+		const uint8_t *string0, uint32_t u, uint32_t run_end,
+		unsigned int font1, unsigned int font,
+		uint32_t *s, size_t *offset)
+{
+	const uint8_t *string1;
+	size_t length1;
+	size_t k = 0;
+	unsigned int v;
+
+	while (*length != 0 && u != run_end) {
+		string1 = *string;
+		length1 = *length;
+		rufl_utf8_read(string1, length1, v);
+		if (v < u || run_end < v)
+			break;
+		s[k] = v;
+		offset[k++] = *string - string0;
+		rufl_process_count(font1, font);
+		rufl_stats.resolve_run_hits++;
+		*string = string1;
+		*length = length1;
+	}
+
+	return k;
+}
+
+
+/**
+ * Empty the character resolution cache.
+ *
+ * Entries are invalidated by moving to a new generation, so this is cheap.
+ */
+
+void rufl_resolve_cache_flush(void)
+{
+	unsigned int i;
+
+	if (++rufl_resolve_cache_generation == rufl_RESOLVE_GENERATION_MAX) {
+		/* out of generations: really empty the cache */
+		for (i = 0; i != rufl_RESOLVE_CACHE_SIZE; i++)
+			rufl_resolve_cache[i].key = 0;
+		rufl_resolve_cache_generation = 1;
+	}
+}
+
+
+/**
+ * Dump character resolution cache statistics to stdout.
+ */
+
+void rufl_resolve_cache_dump(void)
+{
+	unsigned int i, used = 0;
+
+	for (i = 0; i != rufl_RESOLVE_CACHE_SIZE; i++)
+		if (rufl_resolve_cache[i].key >> 37 ==
+				rufl_resolve_cache_generation)
+			used++;
+
+	printf("  %u/%u slots used, %lu hits, %lu misses, %lu run hits\n",
+			used, rufl_RESOLVE_CACHE_SIZE,
+			rufl_stats.resolve_cache_hits,
+			rufl_stats.resolve_cache_misses,
+			rufl_stats.resolve_run_hits);
+}
+
+
+/**
+ * Render a string of characters from a single font, or the hex codes of
+ * characters not available in any font.
+ */
+
+rufl_code rufl_process_run(rufl_action action,
+		const uint32_t *s, unsigned int n,
+		unsigned int font, unsigned int font_size, unsigned int slant,
+		int *x, int y, unsigned int flags,
+		const struct rufl_spacing *spacing,
+		int click_x, size_t *offset,
+		rufl_callback_t callback, void *context)
+{
+	rufl_stats.spans++;
+
+	if (font == NOT_AVAILABLE)
+		return rufl_process_not_available(action, s, n,
+				font_size, x, y, flags, spacing,
+				click_x, offset, callback, context);
+	else if (rufl_old_font_manager)
+		return rufl_process_span_old(action, s, n, font,
+				font_size, slant, x, y, flags, spacing,
+				click_x, offset, callback, context);
+	else
+		return rufl_process_span(action, s, n, font,
+				font_size, slant, x, y, flags, spacing,
+				click_x, offset, callback, context);
+}
+
+
 /**
  * Render a string of characters from a single RISC OS font.
  */
 
 rufl_code rufl_process_span(rufl_action action,
-		uint32_t *s, unsigned int n,
+		const uint32_t *s, unsigned int n,
 		unsigned int font, unsigned int font_size, unsigned int slant,
 		int *x, int y, unsigned int flags,
+		const struct rufl_spacing *spacing,
 		int click_x, size_t *offset,
 		rufl_callback_t callback, void *context)
 {
-	uint32_t *split_point;
+	const uint32_t *split_point;
 	int x_out, y_out;
 	unsigned int i;
-	char font_name[80];
+	const char *font_name;
 	bool oblique = slant && !rufl_font_list[font].slant;
+	os_trfm trfm;
+	font_paint_block paint_block;
+	font_scan_block scan_block;
+	font_string_flags block_flag;
+	int spaced;
+	int scale;
 	font_f f;
 	rufl_code code;
 
-	code = rufl_find_font(font, font_size, "UTF8", &f);
-	if (code != rufl_OK)
-		return code;
+	spaced = rufl_span_spacing(spacing, s, n, &paint_block, &scan_block);
+	block_flag = spacing ? font_GIVEN_BLOCK : 0;
+
+	if (action == rufl_WIDTH || action == rufl_X_TO_OFFSET ||
+			action == rufl_SPLIT || action == rufl_BREAK) {
+		/* measure span without the Font Manager, if possible. When
+		 * splitting, this only works if the whole span fits. */
+		if (rufl_advance_cache_measure(font, font_size, s, n,
+				&x_out) && (action == rufl_WIDTH ||
+				x_out + spaced < (click_x - *x) * 400)) {
+			*offset = n;
+			*x += (x_out + spaced) / 400;
+			return rufl_OK;
+		}
+	}
 
 	if (action == rufl_FONT_BBOX) {
 		os_box *bbox = (os_box *) x;
+
+		code = rufl_find_font(font, font_size, rufl_encoding_utf8,
+				&f);
+		if (code != rufl_OK)
+			return code;
+
 		rufl_fm_error = xfont_read_info(f, &bbox->x0, &bbox->y0,
 				&bbox->x1, &bbox->y1);
 		if (rufl_fm_error)
@@ -323,17 +1256,24 @@ rufl_code rufl_process_span(rufl_action action,
 		return rufl_OK;
 	}
 
+	code = rufl_find_font_scaled(font, font_size, rufl_encoding_utf8,
+			&f, &scale);
+	if (code != rufl_OK)
+		return code;
+	rufl_span_trfm(&trfm, scale, oblique);
+
 	if (action == rufl_PAINT) {
 		/* paint span */
+		rufl_stats.font_paint++;
 		rufl_fm_error = xfont_paint(f, (const char *) s,
-				font_OS_UNITS |
-				(oblique ? font_GIVEN_TRFM : 0) |
+				font_OS_UNITS | block_flag |
+				(scale || oblique ? font_GIVEN_TRFM : 0) |
 				font_GIVEN_LENGTH |
 				font_GIVEN_FONT | font_KERN |
 				font_GIVEN32_BIT |
 				((flags & rufl_BLEND_FONT) ?
 						font_BLEND_FONT : 0),
-				*x, y, 0, &trfm_oblique, n * 4);
+				*x, y, &paint_block, &trfm, n * 4);
 		if (rufl_fm_error) {
 			LOG("xfont_paint: 0x%x: %s",
 					rufl_fm_error->errnum,
@@ -344,29 +1284,48 @@ rufl_code rufl_process_span(rufl_action action,
 			return rufl_FONT_MANAGER_ERROR;
 		}
 	} else if (action == rufl_PAINT_CALLBACK) {
-		snprintf(font_name, sizeof font_name, "%s\\EUTF8",
-				rufl_font_list[font].identifier);
+		font_name = rufl_font_id_name(rufl_FONT_ID(font, 0));
+		if (!font_name)
+			return rufl_OUT_OF_MEMORY;
 		callback(context, font_name, font_size, 0, s, n, *x, y);
+	} else if (action == rufl_PAINT_CALLBACK_ID) {
+		rufl_callback_id_call(context,
+				rufl_FONT_ID(font, 0), font_size,
+				0, s, n, *x, y);
 	}
 
 	/* increment x by width of span */
-	if (action == rufl_X_TO_OFFSET || action == rufl_SPLIT) {
+	if (action == rufl_X_TO_OFFSET || action == rufl_SPLIT ||
+			action == rufl_BREAK) {
+		if (action == rufl_BREAK) {
+			scan_block.split_char = 0x20;
+			block_flag = font_GIVEN_BLOCK;
+		}
+		rufl_stats.font_scan_string++;
 		rufl_fm_error = xfont_scan_string(f, (const char *) s,
 				font_GIVEN_LENGTH | font_GIVEN_FONT |
-				font_KERN | font_GIVEN32_BIT |
+				font_KERN | font_GIVEN32_BIT | block_flag |
+				(scale ? font_GIVEN_TRFM : 0) |
 				((action == rufl_X_TO_OFFSET) ?
 						font_RETURN_CARET_POS : 0),
-				(click_x - *x) * 400, 0x7fffffff, 0, 0,
-				n * 4,
+				(click_x - *x) * 400, 0x7fffffff,
+				&scan_block, &trfm, n * 4,
 				(char **)(void *)&split_point, 
 				&x_out, &y_out, 0);
 		*offset = split_point - s;
+	} else if (action != rufl_WIDTH && rufl_advance_cache_measure(font,
+			font_size, s, n, &x_out)) {
+		/* span width known without the Font Manager */
+		x_out += spaced;
+		rufl_fm_error = NULL;
 	} else {
+		rufl_stats.font_scan_string++;
 		rufl_fm_error = xfont_scan_string(f, (const char *) s,
 				font_GIVEN_LENGTH | font_GIVEN_FONT |
-				font_KERN | font_GIVEN32_BIT,
-				0x7fffffff, 0x7fffffff, 0, 0, n * 4,
-				0, &x_out, &y_out, 0);
+				font_KERN | font_GIVEN32_BIT | block_flag |
+				(scale ? font_GIVEN_TRFM : 0),
+				0x7fffffff, 0x7fffffff, &scan_block, &trfm,
+				n * 4, 0, &x_out, &y_out, 0);
 	}
 	if (rufl_fm_error) {
 		LOG("xfont_scan_string: 0x%x: %s",
@@ -386,9 +1345,10 @@ rufl_code rufl_process_span(rufl_action action,
  */
 
 rufl_code rufl_process_span_old(rufl_action action,
-		uint32_t *s, unsigned int n,
+		const uint32_t *s, unsigned int n,
 		unsigned int font, unsigned int font_size, unsigned int slant,
 		int *x, int y, unsigned int flags,
+		const struct rufl_spacing *spacing,
 		int click_x, size_t *offset,
 		rufl_callback_t callback, void *context)
 {
@@ -397,9 +1357,19 @@ rufl_code rufl_process_span_old(rufl_action action,
 	int x_out, y_out;
 	unsigned int i;
 	bool oblique = slant && !rufl_font_list[font].slant;
+	font_paint_block paint_block;
+	font_scan_block scan_block;
+	font_string_flags block_flag = spacing ? font_GIVEN_BLOCK : 0;
 	font_f f;
 	rufl_code code;
 
+	rufl_span_spacing(spacing, 0, 0, &paint_block, &scan_block);
+	if (action == rufl_BREAK) {
+		/* space is 0x20 in every encoding */
+		scan_block.split_char = 0x20;
+		block_flag = font_GIVEN_BLOCK;
+	}
+
 	if (action == rufl_FONT_BBOX) {
 		os_box *bbox = (os_box *) x;
 
@@ -451,7 +1421,7 @@ rufl_code rufl_process_span_old(rufl_action action,
 
 			if (entry)
 				s2[i++] = entry->c;
-		} while (i != n && entry != NULL);
+		} while (i != n && i != sizeof s2 - 1 && entry != NULL);
 
 		s2[i] = 0;
 
@@ -464,22 +1434,25 @@ rufl_code rufl_process_span_old(rufl_action action,
 			/* call Font_SetFont to work around broken PS printer 
 			 * driver, which doesn't use the font handle from 
 			 * Font_Paint */
-			rufl_fm_error = xfont_set_font(f);
-			if (rufl_fm_error) {
-				LOG("xfont_set_font: 0x%x: %s",
-						rufl_fm_error->errnum,
-						rufl_fm_error->errmess);
-				return rufl_FONT_MANAGER_ERROR;
+			if (rufl_output_context == rufl_CONTEXT_PRINTER) {
+				rufl_fm_error = xfont_set_font(f);
+				if (rufl_fm_error) {
+					LOG("xfont_set_font: 0x%x: %s",
+							rufl_fm_error->errnum,
+							rufl_fm_error->errmess);
+					return rufl_FONT_MANAGER_ERROR;
+				}
 			}
 
+			rufl_stats.font_paint++;
 			rufl_fm_error = xfont_paint(f, (char *) s2,
-					font_OS_UNITS |
+					font_OS_UNITS | block_flag |
 					(oblique ? font_GIVEN_TRFM : 0) |
 					font_GIVEN_LENGTH | font_GIVEN_FONT |
 					font_KERN |
 					((flags & rufl_BLEND_FONT) ?
 							font_BLEND_FONT : 0),
-					*x, y, 0, &trfm_oblique, i);
+					*x, y, &paint_block, &trfm_oblique, i);
 			if (rufl_fm_error) {
 				LOG("xfont_paint: 0x%x: %s",
 						rufl_fm_error->errnum,
@@ -487,36 +1460,39 @@ rufl_code rufl_process_span_old(rufl_action action,
 				return rufl_FONT_MANAGER_ERROR;
 			}
 		} else if (action == rufl_PAINT_CALLBACK) {
-			char font_name[80];
-
-			if (map->encoding)
-				snprintf(font_name, sizeof font_name, "%s\\E%s",
-					rufl_font_list[font].identifier,
-					map->encoding);
-			else
-				snprintf(font_name, sizeof font_name, "%s",
-					rufl_font_list[font].identifier);
+			const char *font_name = rufl_font_id_name(
+					rufl_FONT_ID(font, j));
+			if (!font_name)
+				return rufl_OUT_OF_MEMORY;
 
 			callback(context, font_name, font_size, 
 					s2, 0, i, *x, y);
+		} else if (action == rufl_PAINT_CALLBACK_ID) {
+			rufl_callback_id_call(context,
+					rufl_FONT_ID(font, j), font_size,
+					s2, 0, i, *x, y);
 		}
 
 		/* increment x by width of span */
-		if (action == rufl_X_TO_OFFSET || action == rufl_SPLIT) {
+		if (action == rufl_X_TO_OFFSET || action == rufl_SPLIT ||
+				action == rufl_BREAK) {
+			rufl_stats.font_scan_string++;
 			rufl_fm_error = xfont_scan_string(f, (char *) s2,
 					font_GIVEN_LENGTH | font_GIVEN_FONT |
-					font_KERN |
+					font_KERN | block_flag |
 					((action == rufl_X_TO_OFFSET) ?
 						font_RETURN_CARET_POS : 0),
 					(click_x - *x) * 400, 0x7fffffff, 
-					0, 0, i,
+					&scan_block, 0, i,
 					&split_point, &x_out, &y_out, 0);
 			*offset += split_point - (char *) s2;
 		} else {
+			rufl_stats.font_scan_string++;
 			rufl_fm_error = xfont_scan_string(f, (char *) s2,
 					font_GIVEN_LENGTH | font_GIVEN_FONT | 
-					font_KERN,
-					0x7fffffff, 0x7fffffff, 0, 0, i,
+					font_KERN | block_flag,
+					0x7fffffff, 0x7fffffff,
+					&scan_block, 0, i,
 					0, &x_out, &y_out, 0);
 		}
 		if (rufl_fm_error) {
@@ -527,6 +1503,12 @@ rufl_code rufl_process_span_old(rufl_action action,
 		}
 		*x += x_out / 400;
 
+		/* Stop once the split point has been found */
+		if ((action == rufl_X_TO_OFFSET || action == rufl_SPLIT ||
+				action == rufl_BREAK) &&
+				split_point - (char *) s2 < (int) i)
+			break;
+
 		/* Now update s and n for the next chunk */
 		s += i;
 		n -= i;
@@ -553,15 +1535,16 @@ int rufl_unicode_map_search_cmp(const void *keyval, const void *datum)
  */
 
 rufl_code rufl_process_not_available(rufl_action action,
-		uint32_t *s, unsigned int n,
+		const uint32_t *s, unsigned int n,
 		unsigned int font_size, int *x, int y,
-		unsigned int flags,
+		unsigned int flags, const struct rufl_spacing *spacing,
 		int click_x, size_t *offset,
 		rufl_callback_t callback, void *context)
 {
 	uint8_t missing[] = "000000";
-	const int dx = 7 * font_size / 64;
-	const int dx3 = 10.5 * font_size / 64;
+	const int letter = spacing ? spacing->letter : 0;
+	const int dx = 7 * font_size / 64 + letter;
+	const int dx3 = 10.5 * font_size / 64 + letter;
 	int top_y = y + 5 * font_size / 64;
 	unsigned int i;
 	font_f f;
@@ -581,12 +1564,35 @@ rufl_code rufl_process_not_available(rufl_action action,
 		*offset = i;
 		*x += width;
 		return rufl_OK;
+	} else if (action == rufl_BREAK) {
+		/* there are no spaces, so stop at the first box which does
+		 * not fit */
+		int width = 0;
+		for (i = 0; i != n; i++) {
+			if (click_x - *x < width + ((s[i] < 0x10000) ?
+					dx : dx3))
+				break;
+			width += (s[i] < 0x10000) ? dx : dx3;
+		}
+		*offset = i;
+		*x += width;
+		return rufl_OK;
 	}
 
-	code = rufl_find_font(rufl_CACHE_CORPUS, font_size / 2, "Latin1", &f);
+	code = rufl_find_font(rufl_CACHE_CORPUS, font_size / 2,
+			rufl_encoding_latin1, &f);
 	if (code != rufl_OK)
 		return code;
 
+	if (action == rufl_PAINT && 1 < n) {
+		bool painted;
+
+		code = rufl_paint_hex_boxes(f, s, n, font_size, x, y, flags,
+				letter, &painted);
+		if (code != rufl_OK || painted)
+			return code;
+	}
+
 	for (i = 0; i != n; i++) {
 		int offset = (s[i] < 0x10000) ? 2 : 0;
 		int step = (s[i] < 0x10000) ? 2 : 3;
@@ -600,6 +1606,7 @@ rufl_code rufl_process_not_available(rufl_action action,
 
 		/* first two characters in top row */
 		if (action == rufl_PAINT) {
+			rufl_stats.font_paint++;
 			rufl_fm_error = xfont_paint(f,
 					(char *) (missing + offset),
 					font_OS_UNITS | font_GIVEN_LENGTH |
@@ -609,14 +1616,20 @@ rufl_code rufl_process_not_available(rufl_action action,
 					*x, top_y, 0, 0, step);
 			if (rufl_fm_error)
 				return rufl_FONT_MANAGER_ERROR;
-		} else {
+		} else if (action == rufl_PAINT_CALLBACK) {
 			callback(context, "Corpus.Medium\\ELatin1",
 					font_size / 2, missing + offset, 0,
 					step, *x, top_y);
+		} else {
+			rufl_callback_id_call(context,
+					rufl_FONT_ID_CORPUS,
+					font_size / 2, missing + offset, 0,
+					step, *x, top_y);
 		}
 
 		/* last two characters underneath */
 		if (action == rufl_PAINT) {
+			rufl_stats.font_paint++;
 			rufl_fm_error = xfont_paint(f,
 					(char *) (missing + offset + step),
 					font_OS_UNITS |
@@ -627,10 +1640,15 @@ rufl_code rufl_process_not_available(rufl_action action,
 					*x, y, 0, 0, step);
 			if (rufl_fm_error)
 				return rufl_FONT_MANAGER_ERROR;
-		} else {
+		} else if (action == rufl_PAINT_CALLBACK) {
 			callback(context, "Corpus.Medium\\ELatin1",
 					font_size / 2, missing + offset + step,
 					0, step, *x, y);
+		} else {
+			rufl_callback_id_call(context,
+					rufl_FONT_ID_CORPUS,
+					font_size / 2, missing + offset + step,
+					0, step, *x, y);
 		}
 
 		*x += (s[i] < 0x10000) ? dx : dx3;
@@ -638,3 +1656,217 @@ rufl_code rufl_process_not_available(rufl_action action,
 
 	return rufl_OK;
 }
+
+
+/**
+ * Render the hex codes of a run of characters, with one Font_Paint for each
+ * row of all the boxes.
+ *
+ * Each row is a single string, in which the digits for a character are
+ * followed by a Font Manager horizontal move control sequence to the start
+ * of the box for the next character. The boxes are positioned exactly as
+ * if each row of each box were painted separately. This relies on the
+ * digits all having the same width, which is checked when the handle or
+ * size changes.
+ *
+ * \param  f          Corpus font handle, at half of font_size
+ * \param  s          characters in run
+ * \param  n          number of characters in run
+ * \param  font_size  font size
+ * \param  x          x coordinate, updated to end of run
+ * \param  y          y coordinate of baseline
+ * \param  flags      rufl_paint flags
+ * \param  letter     letter spacing added to each box, in OS units
+ * \param  painted    updated to false if the run must be painted a
+ *                    character at a time instead
+ * \return  rufl_OK on success, or an error code
+ */
+
+rufl_code rufl_paint_hex_boxes(font_f f,
+		const uint32_t *s, unsigned int n,
+		unsigned int font_size, int *x, int y, unsigned int flags,
+		int letter, bool *painted)
+{
+	static const char digits[] = "0123456789abcdef";
+	const int dx = 7 * font_size / 64 + letter;
+	const int dx3 = 10.5 * font_size / 64 + letter;
+	const int top_y = y + 5 * font_size / 64;
+	const font_string_flags paint_flags = font_GIVEN_LENGTH |
+			font_GIVEN_FONT | font_KERN |
+			((flags & rufl_BLEND_FONT) ? font_BLEND_FONT : 0);
+	/* per character: up to 3 digits and a 4 byte move, in each row */
+	uint8_t rows_stack[2 * 7 * rufl_HEX_BOXES_CHUNK];
+	uint8_t *top = rows_stack, *bottom;
+	size_t top_len = 0, bottom_len = 0;
+	int digit_width, digits_width, y_out;
+	int move;
+	unsigned int i, j;
+
+	*painted = false;
+
+	if (rufl_hex_digits.f != f || rufl_hex_digits.font_size != font_size) {
+		rufl_stats.font_scan_string++;
+		rufl_fm_error = xfont_scan_string(f, digits,
+				font_GIVEN_LENGTH | font_GIVEN_FONT |
+				font_KERN,
+				0x7fffffff, 0x7fffffff, 0, 0, 1,
+				0, &digit_width, &y_out, 0);
+		if (!rufl_fm_error) {
+			rufl_stats.font_scan_string++;
+			rufl_fm_error = xfont_scan_string(f, digits,
+					font_GIVEN_LENGTH | font_GIVEN_FONT |
+					font_KERN,
+					0x7fffffff, 0x7fffffff, 0, 0, 16,
+					0, &digits_width, &y_out, 0);
+		}
+		if (rufl_fm_error) {
+			LOG("xfont_scan_string: 0x%x: %s",
+					rufl_fm_error->errnum,
+					rufl_fm_error->errmess);
+			return rufl_FONT_MANAGER_ERROR;
+		}
+		rufl_hex_digits.f = f;
+		rufl_hex_digits.font_size = font_size;
+		rufl_hex_digits.digit_width =
+				digits_width == 16 * digit_width ?
+				digit_width : 0;
+	}
+	digit_width = rufl_hex_digits.digit_width;
+	if (digit_width == 0)
+		return rufl_OK;
+
+	if (rufl_HEX_BOXES_CHUNK < n) {
+		top = malloc(2 * 7 * n);
+		if (!top)
+			return rufl_OUT_OF_MEMORY;
+	}
+	bottom = top + 7 * n;
+
+	for (i = 0; i != n; i++) {
+		unsigned int step = (s[i] < 0x10000) ? 2 : 3;
+
+		if (i != 0) {
+			/* move from the end of the previous box's digits to
+			 * the start of this box, in millipoints */
+			move = ((s[i - 1] < 0x10000) ? dx : dx3) * 400 -
+					(int) ((s[i - 1] < 0x10000) ? 2 : 3) *
+					digit_width;
+			top[top_len++] = 9;
+			top[top_len++] = move & 0xff;
+			top[top_len++] = (move >> 8) & 0xff;
+			top[top_len++] = (move >> 16) & 0xff;
+			memcpy(bottom + bottom_len, top + top_len - 4, 4);
+			bottom_len += 4;
+		}
+
+		for (j = step; j != 0; j--) {
+			top[top_len++] = digits[(s[i] >> (4 * (j + step - 1))) &
+					0xf];
+			bottom[bottom_len++] = digits[(s[i] >> (4 * (j - 1))) &
+					0xf];
+		}
+	}
+
+	rufl_stats.font_paint++;
+	rufl_fm_error = xfont_paint(f, (const char *) top, paint_flags,
+			*x * 400, top_y * 400, 0, 0, top_len);
+	if (!rufl_fm_error) {
+		rufl_stats.font_paint++;
+		rufl_fm_error = xfont_paint(f, (const char *) bottom,
+				paint_flags, *x * 400, y * 400, 0, 0,
+				bottom_len);
+	}
+	if (top != rows_stack)
+		free(top);
+	if (rufl_fm_error) {
+		LOG("xfont_paint: 0x%x: %s",
+				rufl_fm_error->errnum,
+				rufl_fm_error->errmess);
+		return rufl_FONT_MANAGER_ERROR;
+	}
+
+	for (i = 0; i != n; i++)
+		*x += (s[i] < 0x10000) ? dx : dx3;
+	*painted = true;
+
+	return rufl_OK;
+}
+
+
+/**
+ * Build the transform for painting a span.
+ *
+ * \param  trfm     updated to transform
+ * \param  scale    scale from rufl_find_font_scaled(), or 0 for none
+ * \param  oblique  slant the span, like trfm_oblique
+ */
+
+void rufl_span_trfm(os_trfm *trfm, int scale, bool oblique)
+{
+	int a = scale ? scale : 65536;
+
+	trfm->entries[0][0] = a;
+	trfm->entries[0][1] = 0;
+	trfm->entries[1][0] = oblique ? (int) (((int64_t) 13930 * a) >> 16) : 0;
+	trfm->entries[1][1] = a;
+	trfm->entries[2][0] = 0;
+	trfm->entries[2][1] = 0;
+}
+
+
+/**
+ * Fill in the Font Manager blocks for painting and measuring a span with
+ * extra spacing.
+ *
+ * \param  spacing  extra spacing, or 0 for none
+ * \param  s        characters in span, or 0 if not needed
+ * \param  n        number of characters in span
+ * \param  paint    updated to block for Font_Paint, in OS units
+ * \param  scan     updated to block for Font_ScanString, in millipoints
+ * \return  width added to s by the spacing, in millipoints
+ */
+
+int rufl_span_spacing(const struct rufl_spacing *spacing,
+		const uint32_t *s, unsigned int n, font_paint_block *paint,
+		font_scan_block *scan)
+{
+	unsigned int i, spaces = 0;
+
+	memset(paint, 0, sizeof *paint);
+	memset(scan, 0, sizeof *scan);
+	scan->split_char = -1;
+
+	if (!spacing)
+		return 0;
+
+	paint->space.x = spacing->word;
+	paint->letter.x = spacing->letter;
+	scan->space.x = spacing->word * 400;
+	scan->letter.x = spacing->letter * 400;
+
+	if (!s)
+		return 0;
+	for (i = 0; i != n; i++)
+		if (s[i] == 0x20)
+			spaces++;
+
+	return (n * spacing->letter + spaces * spacing->word) * 400;
+}
+
+
+/**
+ * Call the callback of a rufl_paint_callback_id().
+ *
+ * \param  context  struct rufl_callback_id
+ */
+
+void rufl_callback_id_call(void *context,
+		rufl_font_id font_id, unsigned int font_size,
+		const uint8_t *s8, const uint32_t *s32, unsigned int n,
+		int x, int y)
+{
+	const struct rufl_callback_id *id_callback = context;
+
+	id_callback->callback(id_callback->context, font_id, font_size,
+			s8, s32, n, x, y);
+}
@@ -0,0 +1,141 @@
+/*
+ * This file is part of RUfl
+ * Licensed under the MIT License,
+ *                http://www.opensource.org/licenses/mit-license
+ */
+
+#include <assert.h>
+#include "rufl_internal.h"
+
+
+/** Operation performed on font handles by rufl_prefetch_process(). */
+typedef enum { rufl_PREFETCH, rufl_PIN, rufl_UNPIN } rufl_prefetch_action;
+
+static rufl_code rufl_prefetch_process(rufl_prefetch_action action,
+		const struct rufl_sized_font *fonts, size_t count);
+static rufl_code rufl_prefetch_handle(rufl_prefetch_action action,
+		unsigned int font, unsigned int font_size,
+		const char *encoding);
+
+
+/**
+ * Open the font handles for a list of fonts ahead of use.
+ *
+ * \param  fonts  fonts to open
+ * \param  count  number of entries in fonts
+ * \return  rufl_OK on success, or an error code
+ */
+
+rufl_code rufl_font_prefetch(const struct rufl_sized_font *fonts,
+		size_t count)
+{
+	return rufl_prefetch_process(rufl_PREFETCH, fonts, count);
+}
+
+
+/**
+ * Open and pin the font handles for a list of fonts.
+ *
+ * \param  fonts  fonts to pin
+ * \param  count  number of entries in fonts
+ * \return  rufl_OK on success, or an error code
+ */
+
+rufl_code rufl_font_pin(const struct rufl_sized_font *fonts, size_t count)
+{
+	return rufl_prefetch_process(rufl_PIN, fonts, count);
+}
+
+
+/**
+ * Unpin the font handles for a list of fonts.
+ *
+ * \param  fonts  fonts to unpin, as passed to rufl_font_pin()
+ * \param  count  number of entries in fonts
+ */
+
+void rufl_font_unpin(const struct rufl_sized_font *fonts, size_t count)
+{
+	rufl_prefetch_process(rufl_UNPIN, fonts, count);
+}
+
+
+/**
+ * Prefetch, pin, or unpin the font handles for a list of fonts.
+ *
+ * The handles are those used by rufl_process_span() or
+ * rufl_process_span_old() for the requested font, and by
+ * rufl_process_not_available() for the size. rufl_process_span() uses the
+ * handle of the reference size when sizes are shared.
+ */
+
+rufl_code rufl_prefetch_process(rufl_prefetch_action action,
+		const struct rufl_sized_font *fonts, size_t count)
+{
+	struct rufl_face face;
+	unsigned int font_size;
+	size_t i, j;
+	rufl_code code;
+
+	assert(fonts || count == 0);
+
+	for (i = 0; i != count; i++) {
+		code = rufl_face_init(&face, fonts[i].font_family,
+				fonts[i].font_style);
+		if (code != rufl_OK)
+			return code;
+		font_size = fonts[i].font_size;
+
+		if (rufl_old_font_manager) {
+			for (j = 0; j != rufl_font_list[face.font].num_umaps;
+					j++) {
+				code = rufl_prefetch_handle(action, face.font,
+						font_size,
+						rufl_font_list[face.font].
+						umap[j].encoding);
+				if (code != rufl_OK)
+					return code;
+			}
+		} else {
+			code = rufl_prefetch_handle(action, face.font,
+					rufl_shared_size(font_size),
+					rufl_encoding_utf8);
+			if (code != rufl_OK)
+				return code;
+		}
+
+		code = rufl_prefetch_handle(action, rufl_CACHE_CORPUS,
+				font_size / 2, rufl_encoding_latin1);
+		if (code != rufl_OK)
+			return code;
+	}
+
+	return rufl_OK;
+}
+
+
+/**
+ * Prefetch, pin, or unpin a font handle.
+ */
+
+rufl_code rufl_prefetch_handle(rufl_prefetch_action action,
+		unsigned int font, unsigned int font_size,
+		const char *encoding)
+{
+	font_f f;
+	rufl_code code;
+
+	if (action == rufl_UNPIN) {
+		rufl_handle_cache_unpin(font, font_size, encoding);
+		return rufl_OK;
+	}
+
+	code = rufl_find_font(font, font_size, encoding, &f);
+	if (code != rufl_OK)
+		return code;
+
+	if (action == rufl_PIN)
+		rufl_handle_cache_pin(font, font_size, encoding);
+
+	return rufl_OK;
+}
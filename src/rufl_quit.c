@@ -32,10 +32,12 @@ void rufl_quit(void)
 			free(rufl_font_list[i].umap);
 		}
 	}
+	rufl_font_names_free();
 	free(rufl_font_list);
 	rufl_font_list = NULL;
 	rufl_font_list_entries = 0;
 
+	rufl_family_index_free();
 	for (i = 0; i != rufl_family_list_entries; i++)
 		free((void *) rufl_family_list[i]);
 	free(rufl_family_list);
@@ -44,13 +46,9 @@ void rufl_quit(void)
 	rufl_family_list = NULL;
 	rufl_family_list_entries = 0;
 
-	for (i = 0; i != rufl_CACHE_SIZE; i++) {
-		if (rufl_cache[i].font != rufl_CACHE_NONE) {
-			xfont_lose_font(rufl_cache[i].f);
-			rufl_cache[i].font = rufl_CACHE_NONE;
-		}
-	}
-	rufl_cache_time = 0;
+	rufl_handle_cache_fini();
+	rufl_advance_cache_flush();
+	rufl_resolve_cache_flush();
 
         free(rufl_family_menu);
         rufl_family_menu = NULL;
@@ -0,0 +1,63 @@
+/*
+ * This file is part of RUfl
+ * Licensed under the MIT License,
+ *                http://www.opensource.org/licenses/mit-license
+ */
+
+#include <stdio.h>
+#include "rufl_internal.h"
+
+
+struct rufl_stats rufl_stats;
+
+
+/**
+ * Read the library's performance counters.
+ *
+ * \param  stats  updated to current counter values
+ */
+
+void rufl_get_stats(struct rufl_stats *stats)
+{
+	*stats = rufl_stats;
+}
+
+
+/**
+ * Reset the library's performance counters to zero.
+ */
+
+void rufl_reset_stats(void)
+{
+	static const struct rufl_stats zero;
+
+	rufl_stats = zero;
+}
+
+
+/**
+ * Dump performance counters to stdout.
+ */
+
+void rufl_stats_dump(void)
+{
+	printf("  handle cache: %lu hits, %lu misses, %lu evictions, "
+			"%lu exhaustions, %lu shared sizes\n",
+			rufl_stats.handle_cache_hits,
+			rufl_stats.handle_cache_misses,
+			rufl_stats.handle_cache_evictions,
+			rufl_stats.handle_exhaustions,
+			rufl_stats.shared_size_lookups);
+	printf("  Font_Paint %lu, Font_ScanString %lu, Font_FindFont %lu, "
+			"Font_EnumerateCharacters %lu\n",
+			rufl_stats.font_paint,
+			rufl_stats.font_scan_string,
+			rufl_stats.font_find_font,
+			rufl_stats.font_enumerate_characters);
+	printf("  %lu spans, code points: %lu in font, %lu substituted, "
+			"%lu not available\n",
+			rufl_stats.spans,
+			rufl_stats.code_points_font,
+			rufl_stats.code_points_substituted,
+			rufl_stats.code_points_not_available);
+}
@@ -13,6 +13,14 @@
 
 #undef RUFL_SUBSTITUTION_TABLE_DEBUG
 
+/** Most codepoints after the first that a lookup of a range examines, so
+ * that the lookup stays cheap. */
+#define rufl_SUBSTITUTION_RUN_MAX 32
+/** Most codepoints after the first that a lookup of a range examines in a
+ * CHD table. Each codepoint costs two hashes and a displacement read
+ * rather than an array index, so the scan is shorter. */
+#define rufl_SUBSTITUTION_RUN_MAX_CHD 16
+
 /**
  * Base type for a substitution table.
  */
@@ -22,6 +30,10 @@ struct rufl_substitution_table {
 	/** Look up a Unicode codepoint. */
 	unsigned int (*lookup)(const struct rufl_substitution_table *t,
 			uint32_t u);
+	/** Look up a Unicode codepoint and find the end of the range of
+	 * following codepoints in its block with the same result. */
+	unsigned int (*lookup_run)(const struct rufl_substitution_table *t,
+			uint32_t u, uint32_t *run_end);
 	/** Free the resources used by this table */
 	void (*free)(struct rufl_substitution_table *t);
 	/** Dump the contents of this table to stdout */
@@ -115,8 +127,81 @@ struct rufl_substitution_table_chd {
 	 */
 	uint8_t displacement_map[];
 };
+
+/**
+ * Implementation of a substitution table using a two-level trie.
+ *
+ * The first level maps each block of 256 codepoints to a leaf. Blocks
+ * with identical substitutions share a leaf. Each leaf holds a palette of
+ * the fonts used in its block and 256 entries indexing that palette,
+ * packed into 4 bits if the palette has at most 16 fonts and 8 bits
+ * otherwise. Lookup is free of branches.
+ */
+struct rufl_substitution_table_trie {
+	struct rufl_substitution_table base;
+
+	/** Table index.
+	 *
+	 * Each entry represents a block of 256 codepoints, so i[k] refers
+	 * to codepoints [256*k, 256*(k+1)). The value is an index into
+	 * the leaf table.
+	 */
+	uint8_t index[256];
+
+	uint32_t num_leaves; /**< Number of distinct leaves */
+	/** Leaf table */
+	struct rufl_substitution_table_trie_leaf {
+		/** Offset of the leaf's entries in data */
+		uint32_t data;
+		/** Offset of the leaf's palette in palette */
+		uint32_t palette;
+		/** log2 of the bits per entry. Will be 2 or 3. */
+		uint8_t shift;
+		/** Mask of the bits of an entry */
+		uint8_t mask;
+	} *leaf;
+
+	uint32_t palette_size; /**< Number of palette entries */
+	/** Leaf palettes.
+	 *
+	 * Entries are the index into rufl_font_list of a font providing a
+	 * substitution glyph or NOT_AVAILABLE.
+	 */
+	uint16_t *palette;
+
+	uint32_t data_size; /**< Size of leaf entries, in bytes */
+	/** Leaf entries.
+	 *
+	 * Entry k of a leaf is the index into the leaf's palette of the
+	 * substitution for codepoint k of the block. Entries are packed
+	 * least significant bits first.
+	 */
+	uint8_t *data;
+};
+
+/**
+ * Distinct block maps of a plane, from which a trie substitution table
+ * is built.
+ */
+struct rufl_substitution_table_trie_builder {
+	/** Index into maps of each block's map */
+	uint8_t index[256];
+	uint32_t num_maps; /**< Number of distinct maps */
+	uint32_t hash[256]; /**< Hash of each distinct map */
+	uint16_t fonts[256]; /**< Number of fonts in each distinct map */
+	uint16_t maps[256][256]; /**< Distinct maps */
+};
 /** Font substitution tables -- one per plane */
 static struct rufl_substitution_table *rufl_substitution_table[17];
+/** Planes in which any font has glyphs -- bit n represents plane n */
+static uint32_t rufl_substitution_table_planes_covered;
+/** Planes for which a substitution table has been constructed */
+static uint32_t rufl_substitution_table_planes_built;
+/** Policy set by rufl_set_substitution_policy() */
+static rufl_substitution_policy rufl_substitution_policy_requested =
+		rufl_SUBSTITUTION_FIRST_FONT;
+/** Policy in effect since rufl_substitution_table_init() */
+static rufl_substitution_policy rufl_substitution_table_policy;
 
 /**
  * Round an unsigned 32bit value up to the next power of 2
@@ -262,6 +347,22 @@ static bool test_and_set_bits(uint8_t *bitmap, const uint32_t *idx, size_t len)
 	return result;
 }
 
+/**
+ * Find the end of the range of codepoints from u with the same result,
+ * looking no further than the end of u's block or limit codepoints
+ */
+static uint32_t scan_run(const struct rufl_substitution_table *t,
+		uint32_t u, unsigned int font, unsigned int limit)
+{
+	uint32_t end = u;
+
+	while ((end & 0xff) != 0xff && end - u != limit &&
+			t->lookup(t, end + 1) == font)
+		end++;
+
+	return end;
+}
+
 static void rufl_substitution_table_free_chd(
 		struct rufl_substitution_table *t)
 {
@@ -320,6 +421,17 @@ static int table_dump_cmp(const void *a, const void *b)
 	return 0;
 }
 
+static unsigned int rufl_substitution_table_lookup_run_chd(
+		const struct rufl_substitution_table *ts, uint32_t u,
+		uint32_t *run_end)
+{
+	unsigned int font = rufl_substitution_table_lookup_chd(ts, u);
+
+	*run_end = scan_run(ts, u, font, rufl_SUBSTITUTION_RUN_MAX_CHD);
+
+	return font;
+}
+
 static void rufl_substitution_table_dump_chd(
 		const struct rufl_substitution_table *ts, unsigned int plane)
 {
@@ -430,6 +542,8 @@ static rufl_code create_substitution_table_chd(uint64_t *table,
 
 	subst_table->base.desc = "CHD";
 	subst_table->base.lookup = rufl_substitution_table_lookup_chd;
+	subst_table->base.lookup_run =
+			rufl_substitution_table_lookup_run_chd;
 	subst_table->base.free = rufl_substitution_table_free_chd;
 	subst_table->base.dump = rufl_substitution_table_dump_chd;
 	subst_table->base.size = rufl_substitution_table_size_chd;
@@ -703,6 +817,37 @@ static unsigned int rufl_substitution_table_lookup_direct(
 	return font;
 }
 
+static unsigned int rufl_substitution_table_lookup_run_direct(
+		const struct rufl_substitution_table *ts, uint32_t u,
+		uint32_t *run_end)
+{
+	const struct rufl_substitution_table_direct *t = (const void *) ts;
+	uint32_t block = (u >> 8) & 0xff;
+	uint32_t slot = (u & 0xff);
+	uint32_t last = slot + rufl_SUBSTITUTION_RUN_MAX < 0xff ?
+			slot + rufl_SUBSTITUTION_RUN_MAX : 0xff;
+	unsigned int font;
+
+	if (t->bits_per_entry == 8) {
+		const uint8_t *t8 = (const uint8_t *) t->table +
+				t->index[block] * 256;
+		font = t8[slot];
+		while (slot != last && t8[slot + 1] == font)
+			slot++;
+		if (font == (NOT_AVAILABLE & 0xff))
+			font = NOT_AVAILABLE;
+	} else {
+		const uint16_t *t16 = t->table + t->index[block] * 256;
+		font = t16[slot];
+		while (slot != last && t16[slot + 1] == font)
+			slot++;
+	}
+
+	*run_end = (u & ~0xffu) | slot;
+
+	return font;
+}
+
 static void rufl_substitution_table_dump_direct(
 		const struct rufl_substitution_table *ts, unsigned int plane)
 {
@@ -786,6 +931,8 @@ static rufl_code direct(uint64_t *table, size_t table_entries,
 
 	subst_table->base.desc = "Direct";
 	subst_table->base.lookup = rufl_substitution_table_lookup_direct;
+	subst_table->base.lookup_run =
+			rufl_substitution_table_lookup_run_direct;
 	subst_table->base.free = rufl_substitution_table_free_direct;
 	subst_table->base.dump = rufl_substitution_table_dump_direct;
 	subst_table->base.size = rufl_substitution_table_size_direct;
@@ -870,32 +1017,371 @@ static size_t rufl_substitution_table_estimate_size_direct(size_t table_entries,
 
 /****************************************************************************/
 
+static void rufl_substitution_table_free_trie(
+		struct rufl_substitution_table *t)
+{
+	struct rufl_substitution_table_trie *trie = (void *) t;
+
+	free(trie->leaf);
+	free(trie->palette);
+	free(trie->data);
+	free(t);
+}
+
+
+static unsigned int rufl_substitution_table_lookup_trie(
+		const struct rufl_substitution_table *ts, uint32_t u)
+{
+	const struct rufl_substitution_table_trie *t = (const void *) ts;
+	const struct rufl_substitution_table_trie_leaf *leaf =
+			&t->leaf[t->index[(u >> 8) & 0xff]];
+	uint32_t bit = (u & 0xff) << leaf->shift;
+	unsigned int entry;
+
+	entry = (t->data[leaf->data + (bit >> 3)] >> (bit & 7)) & leaf->mask;
+
+	return t->palette[leaf->palette + entry];
+}
+
+static unsigned int rufl_substitution_table_lookup_run_trie(
+		const struct rufl_substitution_table *ts, uint32_t u,
+		uint32_t *run_end)
+{
+	unsigned int font = rufl_substitution_table_lookup_trie(ts, u);
+
+	*run_end = scan_run(ts, u, font, rufl_SUBSTITUTION_RUN_MAX);
+
+	return font;
+}
+
+static void rufl_substitution_table_dump_trie(
+		const struct rufl_substitution_table *ts, unsigned int plane)
+{
+	unsigned int font;
+	unsigned int u, prev;
+
+	u = 0;
+	while (u < 0x10000) {
+		prev = u;
+		font = rufl_substitution_table_lookup_trie(ts, u);
+		while (u < 0x10000 &&
+				font == rufl_substitution_table_lookup_trie(
+						ts, u))
+			u++;
+		if (font != NOT_AVAILABLE)
+			printf("  %x-%x => %u \"%s\"\n",
+					(plane << 16) | prev,
+					(plane << 16) | (u - 1),
+					font, rufl_font_list[font].identifier);
+	}
+}
+
+static size_t rufl_substitution_table_size_trie(
+		const struct rufl_substitution_table *ts,
+		unsigned int *glyph_count)
+{
+	const struct rufl_substitution_table_trie *t = (const void *) ts;
+	size_t size = sizeof(*t);
+	unsigned int u, count = 0;
+
+	size += t->num_leaves * sizeof(*t->leaf);
+	size += t->palette_size * sizeof(*t->palette);
+	size += t->data_size;
+
+	for (u = 0; u < 0x10000; u++)
+		if (rufl_substitution_table_lookup_trie(ts, u) !=
+				NOT_AVAILABLE)
+			count++;
+	if (glyph_count != NULL)
+		*glyph_count = count;
+
+	return size;
+}
+
+static int table_trie_cmp(const void *a, const void *b)
+{
+	uint16_t aa = *(const uint16_t *) a;
+	uint16_t bb = *(const uint16_t *) b;
+
+	return aa < bb ? -1 : aa > bb ? 1 : 0;
+}
+
+/**
+ * Compute the palette of a block map
+ *
+ * \param map      block map
+ * \param palette  filled with the distinct fonts in the map, in order
+ * \return number of fonts in the palette
+ */
+static unsigned int trie_palette(const uint16_t map[256],
+		uint16_t palette[256])
+{
+	unsigned int i, n;
+
+	memcpy(palette, map, 256 * sizeof(*palette));
+	qsort(palette, 256, sizeof(*palette), table_trie_cmp);
+
+	for (i = 1, n = 1; i != 256; i++)
+		if (palette[i] != palette[n - 1])
+			palette[n++] = palette[i];
+
+	return n;
+}
+
+/**
+ * Compute log2 of the bits per entry of a leaf with a palette of a size
+ */
+static uint8_t trie_shift(unsigned int fonts)
+{
+	return fonts <= 16 ? 2 : 3;
+}
+
+/**
+ * Add a block map to a trie builder, sharing any identical map
+ */
+static void trie_add_block(struct rufl_substitution_table_trie_builder *b,
+		uint32_t block, const uint16_t map_for_block[256])
+{
+	uint16_t palette[256];
+	uint32_t hash = 2166136261u;
+	unsigned int i;
+
+	for (i = 0; i != 256; i++)
+		hash = (hash ^ map_for_block[i]) * 16777619u;
+
+	for (i = 0; i != b->num_maps; i++) {
+		if (b->hash[i] == hash && memcmp(b->maps[i], map_for_block,
+				sizeof(b->maps[i])) == 0) {
+			b->index[block] = i;
+			return;
+		}
+	}
+
+	b->index[block] = b->num_maps;
+	b->hash[b->num_maps] = hash;
+	b->fonts[b->num_maps] = trie_palette(map_for_block, palette);
+	memcpy(b->maps[b->num_maps], map_for_block, sizeof(b->maps[0]));
+	b->num_maps++;
+}
+
+/**
+ * Construct a trie substitution table
+ */
+static rufl_code trie(const struct rufl_substitution_table_trie_builder *b,
+		struct rufl_substitution_table **substitution_table)
+{
+	struct rufl_substitution_table_trie *subst_table;
+	struct rufl_substitution_table_trie_leaf *leaf;
+	uint16_t palette[256], *entry;
+	uint32_t palette_offset = 0;
+	unsigned int i, slot;
+	uint32_t bit;
+
+	subst_table = calloc(1, sizeof(*subst_table));
+	if (!subst_table)
+		return rufl_OUT_OF_MEMORY;
+
+	subst_table->base.desc = "Trie";
+	subst_table->base.lookup = rufl_substitution_table_lookup_trie;
+	subst_table->base.lookup_run =
+			rufl_substitution_table_lookup_run_trie;
+	subst_table->base.free = rufl_substitution_table_free_trie;
+	subst_table->base.dump = rufl_substitution_table_dump_trie;
+	subst_table->base.size = rufl_substitution_table_size_trie;
+	memcpy(subst_table->index, b->index, sizeof(subst_table->index));
+	subst_table->num_leaves = b->num_maps;
+
+	for (i = 0; i != b->num_maps; i++) {
+		subst_table->palette_size += b->fonts[i];
+		subst_table->data_size += (256 << trie_shift(b->fonts[i])) >> 3;
+	}
+
+	subst_table->leaf = malloc(b->num_maps * sizeof(*subst_table->leaf));
+	subst_table->palette = malloc(subst_table->palette_size *
+			sizeof(*subst_table->palette));
+	subst_table->data = calloc(subst_table->data_size, 1);
+	if (!subst_table->leaf || !subst_table->palette ||
+			!subst_table->data) {
+		rufl_substitution_table_free_trie(&subst_table->base);
+		return rufl_OUT_OF_MEMORY;
+	}
+
+	/* Populate the leaves */
+	for (i = 0, leaf = subst_table->leaf; i != b->num_maps; i++, leaf++) {
+		leaf->data = i ? leaf[-1].data +
+				((256 << leaf[-1].shift) >> 3) : 0;
+		leaf->palette = palette_offset;
+		leaf->shift = trie_shift(b->fonts[i]);
+		leaf->mask = (1 << (1 << leaf->shift)) - 1;
+
+		trie_palette(b->maps[i], palette);
+		memcpy(subst_table->palette + palette_offset, palette,
+				b->fonts[i] * sizeof(*palette));
+
+		for (slot = 0; slot != 256; slot++) {
+			entry = bsearch(&b->maps[i][slot], palette,
+					b->fonts[i], sizeof(*palette),
+					table_trie_cmp);
+			assert(entry != NULL);
+			bit = slot << leaf->shift;
+			subst_table->data[leaf->data + (bit >> 3)] |=
+					(entry - palette) << (bit & 7);
+		}
+
+		palette_offset += b->fonts[i];
+	}
+
+#ifdef RUFL_SUBSTITUTION_TABLE_DEBUG
+	LOG("leaves = %u palette-size = %u data-size = %u",
+			subst_table->num_leaves, subst_table->palette_size,
+			subst_table->data_size);
+#endif
+
+	*substitution_table = &subst_table->base;
+
+	return rufl_OK;
+}
+
+static size_t rufl_substitution_table_estimate_size_trie(
+		const struct rufl_substitution_table_trie_builder *b)
+{
+	size_t size = sizeof(struct rufl_substitution_table_trie);
+	unsigned int i;
+
+	for (i = 0; i != b->num_maps; i++) {
+		size += sizeof(struct rufl_substitution_table_trie_leaf);
+		size += b->fonts[i] * sizeof(uint16_t);
+		size += (256 << trie_shift(b->fonts[i])) >> 3;
+	}
+
+	return size;
+}
+
+/****************************************************************************/
+
+/**
+ * Read a word of a character set's bitmap for a block
+ *
+ * Bit k of word w represents codepoint 32*w+k of the block.
+ */
+static uint32_t block_word(const struct rufl_character_set *charset,
+		uint32_t block, unsigned int w)
+{
+	const uint8_t *blk;
+
+	if (charset->index[block] == BLOCK_FULL)
+		return 0xffffffff;
+
+	blk = charset->block[charset->index[block]] + 4 * w;
+
+	return blk[0] | (blk[1] << 8) | (blk[2] << 16) |
+			((uint32_t) blk[3] << 24);
+}
+
+/**
+ * Count the bits set in a word
+ */
+static unsigned int count_bits(uint32_t val)
+{
+	val = val - ((val >> 1) & 0x55555555);
+	val = (val & 0x33333333) + ((val >> 2) & 0x33333333);
+	return (((val + (val >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24;
+}
+
+/**
+ * Assign a font to the codepoints of a block map in a word of a bitmap
+ */
+static void assign_word(uint16_t map_for_block[256], unsigned int w,
+		uint32_t bits, unsigned int font)
+{
+	unsigned int u;
+
+	for (u = 32 * w; bits; u++, bits >>= 1)
+		if (bits & 1)
+			map_for_block[u] = font;
+}
+
 /**
  * Populate the substitution map for a given block
+ *
+ * The map must be filled with NOT_AVAILABLE on entry. Each codepoint is
+ * assigned the first font that has a glyph for it. The codepoints still
+ * unassigned are tracked in a bitmap, so the fonts' block bitmaps are
+ * consumed a word at a time and no more fonts are visited once every
+ * codepoint is assigned.
  */
 static void fill_map_for_block(const struct rufl_character_set **charsets,
 		uint32_t block, uint16_t map_for_block[256])
 {
-	unsigned int i, u;
+	uint32_t unassigned[8], bits, remaining;
+	unsigned int i, w;
+
+	for (w = 0; w != 8; w++)
+		unassigned[w] = 0xffffffff;
 
 	for (i = 0; i != rufl_font_list_entries; i++) {
-		if (!charsets[i])
+		if (!charsets[i] || charsets[i]->index[block] == BLOCK_EMPTY)
 			continue;
 
-		if (charsets[i]->index[block] == BLOCK_FULL) {
-			for (u = 0; u != 256; u++)
-				if (map_for_block[u] == NOT_AVAILABLE)
-					map_for_block[u] = i;
-		} else if (charsets[i]->index[block] != BLOCK_EMPTY) {
-			const uint8_t *blk = charsets[i]->block[
-					charsets[i]->index[block]];
-			for (u = 0; u != 256; u++) {
-				if (map_for_block[u] == NOT_AVAILABLE &&
-						(blk[(u>>3)] & (1 << (u&7)))) {
-					map_for_block[u] = i;
-				}
+		remaining = 0;
+		for (w = 0; w != 8; w++) {
+			bits = unassigned[w] &
+					block_word(charsets[i], block, w);
+			unassigned[w] &= ~bits;
+			remaining |= unassigned[w];
+			assign_word(map_for_block, w, bits, i);
+		}
+
+		if (!remaining)
+			break;
+	}
+}
+
+/**
+ * Populate the substitution map for a given block, using as few fonts as
+ * possible
+ *
+ * The map must be filled with NOT_AVAILABLE on entry. The font with
+ * glyphs for most unassigned codepoints is assigned to them, the first
+ * such font winning ties, until no font has glyphs for any unassigned
+ * codepoint.
+ */
+static void fill_map_for_block_locality(
+		const struct rufl_character_set **charsets,
+		uint32_t block, uint16_t map_for_block[256])
+{
+	uint32_t unassigned[8], bits;
+	unsigned int i, w, count, best = 0, best_count, remaining = 256;
+
+	for (w = 0; w != 8; w++)
+		unassigned[w] = 0xffffffff;
+
+	while (remaining) {
+		best_count = 0;
+		for (i = 0; i != rufl_font_list_entries; i++) {
+			if (!charsets[i] || charsets[i]->index[block] ==
+					BLOCK_EMPTY)
+				continue;
+
+			for (w = 0, count = 0; w != 8; w++)
+				count += count_bits(unassigned[w] &
+						block_word(charsets[i],
+								block, w));
+			if (best_count < count) {
+				best = i;
+				best_count = count;
 			}
 		}
+		if (!best_count)
+			break;
+
+		for (w = 0; w != 8; w++) {
+			bits = unassigned[w] & block_word(charsets[best],
+					block, w);
+			unassigned[w] &= ~bits;
+			assign_word(map_for_block, w, bits, best);
+		}
+		remaining -= best_count;
 	}
 }
 
@@ -915,7 +1401,8 @@ static rufl_code create_substitution_table_for_plane(unsigned int plane)
 	size_t table_entries;
 	uint8_t block_histogram[256];
 	size_t blocks_used;
-	size_t direct_size, chd_size;
+	struct rufl_substitution_table_trie_builder *trie_builder;
+	size_t direct_size, chd_size, trie_size;
 	rufl_code result;
 
 	charsets = malloc(rufl_font_list_entries * sizeof(*charsets));
@@ -962,6 +1449,15 @@ static rufl_code create_substitution_table_for_plane(unsigned int plane)
 	table_size = 1024;
 	table_entries = 0;
 
+	trie_builder = malloc(sizeof(*trie_builder));
+	if (!trie_builder) {
+		LOG("malloc(%zu) failed", sizeof(*trie_builder));
+		free(table);
+		free(charsets);
+		return rufl_OUT_OF_MEMORY;
+	}
+	trie_builder->num_maps = 0;
+
 	/* Process each block, finding fonts that have glyphs */
 	blocks_used = 0;
 	memset(block_histogram, 0, 256);
@@ -971,7 +1467,13 @@ static rufl_code create_substitution_table_for_plane(unsigned int plane)
 		for (i = 0; i != 256; i++)
 			map_for_block[i] = NOT_AVAILABLE;
 
-		fill_map_for_block(charsets, block, map_for_block);
+		if (rufl_substitution_table_policy ==
+				rufl_SUBSTITUTION_LOCALITY)
+			fill_map_for_block_locality(charsets, block,
+					map_for_block);
+		else
+			fill_map_for_block(charsets, block, map_for_block);
+		trie_add_block(trie_builder, block, map_for_block);
 
 		/* Merge block map into table */
 		for (i = 0; i != 256; i++) {
@@ -988,7 +1490,9 @@ static rufl_code create_substitution_table_for_plane(unsigned int plane)
 					LOG("realloc(%zu) failed",
 						2 * table_size *
 							sizeof(*table));
+					free(trie_builder);
 					free(table);
+					free(charsets);
 					return rufl_OUT_OF_MEMORY;
 				}
 
@@ -1007,6 +1511,7 @@ static rufl_code create_substitution_table_for_plane(unsigned int plane)
 		LOG("no glyphs for plane %u", plane);
 #endif
 		rufl_substitution_table[plane] = NULL;
+		free(trie_builder);
 		free(table);
 		free(charsets);
 		return rufl_OK;
@@ -1018,7 +1523,11 @@ static rufl_code create_substitution_table_for_plane(unsigned int plane)
 			table_entries, blocks_used);
 	chd_size = rufl_substitution_table_estimate_size_chd(
 			table_entries, blocks_used);
-	if (direct_size <= chd_size) {
+	trie_size = rufl_substitution_table_estimate_size_trie(trie_builder);
+	if (trie_size < direct_size && trie_size < chd_size) {
+		result = trie(trie_builder, &rufl_substitution_table[plane]);
+		free(table);
+	} else if (direct_size <= chd_size) {
 		result = direct(table, table_entries, blocks_used,
 				block_histogram,
 				&rufl_substitution_table[plane]);
@@ -1030,46 +1539,86 @@ static rufl_code create_substitution_table_for_plane(unsigned int plane)
 #ifdef RUFL_SUBSTITUTION_TABLE_DEBUG
 	LOG("plane %u: table-entries = %zu blocks-used = %zu"
 		       " estimated-direct-size = %zu estimated-chd-size = %zu"
-		       " actual-size = %zu",
+		       " estimated-trie-size = %zu actual-size = %zu",
 			plane, table_entries, blocks_used,
-			direct_size, chd_size,
+			direct_size, chd_size, trie_size,
 			rufl_substitution_table[plane] ?
 				rufl_substitution_table[plane]->size(
 					rufl_substitution_table[plane],
 					NULL) : 0);
 #endif
 
+	free(trie_builder);
 	free(charsets);
 
 	return result;
 }
 
 /**
- * Construct the font substitution table.
+ * Find the planes in which any font has glyphs
  */
-
-rufl_code rufl_substitution_table_init(void)
+static uint32_t find_planes_covered(void)
 {
-	unsigned int plane;
-	rufl_code rc;
+	const struct rufl_character_set *charset;
+	uint32_t planes = 0;
+	unsigned int i, block;
 
-	for (plane = 0; plane < 17; plane++) {
-		rc = create_substitution_table_for_plane(plane);
-		if (rc != rufl_OK) {
-			while (plane > 0) {
-				plane--;
-				if (!rufl_substitution_table[plane])
-					continue;
-				rufl_substitution_table[plane]->free(
-						rufl_substitution_table[plane]);
+	for (i = 0; i != rufl_font_list_entries; i++) {
+		for (charset = rufl_font_list[i].charset; charset;
+				charset = EXTENSION_FOLLOWS(charset->metadata) ?
+				(void *)(((uint8_t *) charset) +
+				PLANE_SIZE(charset->metadata)) : NULL) {
+			for (block = 0; block != 256; block++) {
+				if (charset->index[block] != BLOCK_EMPTY) {
+					planes |= 1u << PLANE_ID(
+							charset->metadata);
+					break;
+				}
 			}
-			return rc;
 		}
 	}
 
+	return planes;
+}
+
+/**
+ * Construct the substitution table for a plane, unless already done
+ */
+static rufl_code build_substitution_table_for_plane(unsigned int plane)
+{
+	rufl_code rc;
+
+	if (rufl_substitution_table_planes_built & (1u << plane))
+		return rufl_OK;
+
+	rc = create_substitution_table_for_plane(plane);
+	if (rc != rufl_OK)
+		return rc;
+
+	rufl_substitution_table_planes_built |= 1u << plane;
+
 	return rufl_OK;
 }
 
+/**
+ * Construct the font substitution table.
+ *
+ * Only the table for the Basic Multilingual Plane is constructed here.
+ * Tables for the other planes are constructed by the first lookup in
+ * the plane.
+ */
+
+rufl_code rufl_substitution_table_init(void)
+{
+	rufl_substitution_table_policy = rufl_substitution_policy_requested;
+	rufl_substitution_table_planes_covered = find_planes_covered();
+	/* Planes without glyphs need no table */
+	rufl_substitution_table_planes_built =
+			~rufl_substitution_table_planes_covered & 0x1ffff;
+
+	return build_substitution_table_for_plane(0);
+}
+
 /**
  * Destroy the substitution table and clean up its resources
  */
@@ -1084,23 +1633,101 @@ void rufl_substitution_table_fini(void)
 					rufl_substitution_table[plane]);
 		rufl_substitution_table[plane] = NULL;
 	}
+
+	rufl_substitution_table_planes_covered = 0;
+	rufl_substitution_table_planes_built = 0;
 }
 
 /**
- * Look up a Unicode codepoint in the substitution table
+ * Set the policy for choosing substitute fonts.
+ */
+
+void rufl_set_substitution_policy(rufl_substitution_policy policy)
+{
+	rufl_substitution_policy_requested = policy;
+}
+
+/**
+ * Look up a Unicode codepoint in the substitution table, constructing the
+ * table for its plane if this is the first lookup in the plane
  */
 
 unsigned int rufl_substitution_table_lookup(uint32_t u)
 {
 	unsigned int plane = (u >> 16) & 0x1f;
+	rufl_code rc;
 
-	if (17 <= plane || !rufl_substitution_table[plane])
+	if (17 <= plane)
+		return NOT_AVAILABLE;
+
+	if (!(rufl_substitution_table_planes_built & (1u << plane))) {
+		rc = build_substitution_table_for_plane(plane);
+		if (rc != rufl_OK) {
+			LOG("build_substitution_table_for_plane(%u): 0x%x",
+					plane, rc);
+			return NOT_AVAILABLE;
+		}
+	}
+
+	if (!rufl_substitution_table[plane])
 		return NOT_AVAILABLE;
 
 	return rufl_substitution_table[plane]->lookup(
 			rufl_substitution_table[plane], u);
 }
 
+/**
+ * Look up a Unicode codepoint in the substitution table, and find the end
+ * of the range of following codepoints with the same result
+ *
+ * The range may end before the last such codepoint. It ends at the latest
+ * rufl_SUBSTITUTION_RUN_MAX codepoints after u, or at the end of the block
+ * of 256 codepoints containing u.
+ *
+ * Unlike rufl_substitution_table_lookup(), this reports a failure to
+ * construct the table for the plane, so that the result is not mistaken
+ * for a character that no font has.
+ *
+ * \param  u        Unicode codepoint
+ * \param  font     updated to index in rufl_font_list, or NOT_AVAILABLE
+ * \param  run_end  updated to the last codepoint of the range
+ * \return  rufl_OK on success, or an error code if the table for the plane
+ *          could not be constructed
+ */
+
+rufl_code rufl_substitution_table_lookup_run(uint32_t u, unsigned int *font,
+		uint32_t *run_end)
+{
+	unsigned int plane = (u >> 16) & 0x1f;
+	rufl_code rc;
+
+	*font = NOT_AVAILABLE;
+	*run_end = u;
+
+	if (17 <= plane)
+		return rufl_OK;
+
+	if (!(rufl_substitution_table_planes_built & (1u << plane))) {
+		rc = build_substitution_table_for_plane(plane);
+		if (rc != rufl_OK) {
+			LOG("build_substitution_table_for_plane(%u): 0x%x",
+					plane, rc);
+			return rc;
+		}
+	}
+
+	if (!rufl_substitution_table[plane]) {
+		*run_end = (u | 0xff) < u + rufl_SUBSTITUTION_RUN_MAX ?
+				(u | 0xff) : u + rufl_SUBSTITUTION_RUN_MAX;
+		return rufl_OK;
+	}
+
+	*font = rufl_substitution_table[plane]->lookup_run(
+			rufl_substitution_table[plane], u, run_end);
+
+	return rufl_OK;
+}
+
 /**
  * Dump a representation of the substitution table to stdout.
  */
@@ -1122,7 +1749,11 @@ void rufl_substitution_table_dump(void)
 		unsigned int plane_glyphs;
 		const char *plane_desc;
 
-		if (!rufl_substitution_table[plane]) {
+		if (!(rufl_substitution_table_planes_built & (1u << plane))) {
+			plane_size = 0;
+			plane_glyphs = 0;
+			plane_desc = "Deferred";
+		} else if (!rufl_substitution_table[plane]) {
 			plane_size = 0;
 			plane_glyphs = 0;
 			plane_desc = "None";
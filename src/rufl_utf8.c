@@ -0,0 +1,155 @@
+/*
+ * This file is part of RUfl
+ * Licensed under the MIT License,
+ *                http://www.opensource.org/licenses/mit-license
+ */
+
+#include <string.h>
+#include "rufl_internal.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+
+/** Bitmap of U+0020 to U+007E, indexed as in struct rufl_character_set. */
+static const uint8_t rufl_ascii_printable[16] = {
+	0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x7f
+};
+
+/** Word with every byte set to n. */
+#define rufl_WORD_BYTES(n) (((size_t) -1 / 255) * (n))
+
+
+static size_t rufl_utf8_printable_span(const uint8_t *s, size_t l);
+
+
+/**
+ * Find the printable ASCII characters in a character set.
+ *
+ * \param  charset  character set, or 0 for none
+ * \param  ascii    filled in with the printable ASCII characters present
+ */
+
+void rufl_character_set_ascii(const struct rufl_character_set *charset,
+		struct rufl_ascii_set *ascii)
+{
+	unsigned int i;
+
+	memset(ascii, 0, sizeof *ascii);
+
+	if (!charset)
+		return;
+
+	/* Look for the Basic Multilingual Plane */
+	while (PLANE_ID(charset->metadata) != 0 &&
+			EXTENSION_FOLLOWS(charset->metadata)) {
+		charset = (const void *)(((const uint8_t *)charset) +
+				PLANE_SIZE(charset->metadata));
+	}
+	if (PLANE_ID(charset->metadata) != 0 ||
+			charset->index[0] == BLOCK_EMPTY)
+		return;
+
+	for (i = 0; i != sizeof ascii->bits; i++) {
+		if (charset->index[0] == BLOCK_FULL)
+			ascii->bits[i] = rufl_ascii_printable[i];
+		else
+			ascii->bits[i] = rufl_ascii_printable[i] &
+					charset->block[charset->index[0]][i];
+	}
+
+	ascii->all = memcmp(ascii->bits, rufl_ascii_printable,
+			sizeof ascii->bits) == 0;
+}
+
+
+/**
+ * Find the length of the initial run of a UTF-8 string which consists of
+ * printable ASCII characters in a set.
+ *
+ * Each byte of the run decodes to a single character with the same value,
+ * exactly as rufl_utf8_read() would decode it.
+ *
+ * \param  ascii  set of printable ASCII characters
+ * \param  s      UTF-8 string
+ * \param  l      length of string in bytes
+ * \return  number of bytes in run
+ */
+
+size_t rufl_utf8_ascii_span(const struct rufl_ascii_set *ascii,
+		const uint8_t *s, size_t l)
+{
+	size_t i = 0;
+	uint8_t c;
+
+	/* Where every printable character is present, only the byte values
+	 * need to be checked, which may be done many bytes at a time. */
+	if (ascii->all)
+		i = rufl_utf8_printable_span(s, l);
+
+	for (; i != l; i++) {
+		c = s[i];
+		if (0x80 <= c || !(ascii->bits[c >> 3] & (1 << (c & 7))))
+			break;
+	}
+
+	return i;
+}
+
+
+/**
+ * Find the length of the initial run of a string which consists of bytes
+ * in the range 0x20 to 0x7e.
+ *
+ * The run may be underestimated by up to one word, but never overestimated.
+ */
+
+size_t rufl_utf8_printable_span(const uint8_t *s, size_t l)
+{
+	size_t i = 0;
+	size_t w;
+
+#if defined(__SSE2__)
+	const __m128i lo = _mm_set1_epi8(0x1f);
+	const __m128i hi = _mm_set1_epi8(0x7f);
+
+	/* the comparisons are signed, so 0x80 to 0xff are below lo */
+	while (16 <= l - i) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+		__m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, lo),
+				_mm_cmplt_epi8(v, hi));
+		if (_mm_movemask_epi8(ok) != 0xffff)
+			break;
+		i += 16;
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	const uint8x16_t lo = vdupq_n_u8(0x20);
+	const uint8x16_t hi = vdupq_n_u8(0x7e);
+
+	while (16 <= l - i) {
+		uint8x16_t v = vld1q_u8(s + i);
+		uint8x16_t ok = vandq_u8(vcgeq_u8(v, lo), vcleq_u8(v, hi));
+		if (vminvq_u8(ok) != 0xff)
+			break;
+		i += 16;
+	}
+#endif
+
+	/* A byte is outside the range if it is below 0x20, or if adding 1
+	 * to it or the byte itself sets the top bit. The tests are exact
+	 * for the word as a whole, although not for individual bytes. */
+	while (sizeof w <= l - i) {
+		memcpy(&w, s + i, sizeof w);
+		if ((((w - rufl_WORD_BYTES(0x20)) & ~w) |
+				(w + rufl_WORD_BYTES(0x01)) | w) &
+				rufl_WORD_BYTES(0x80))
+			break;
+		i += sizeof w;
+	}
+
+	return i;
+}
@@ -352,6 +352,8 @@ os_error *xfont_scan_string (font_f font, char const *s,
 {
 	size_t advance = 1;
 	int width = 0;
+	int split_char = -1, split_width = 0;
+	char const *split = NULL;
 
 	if (!(flags & font_GIVEN_FONT) || font == 0)
 		font = h->current_font;
@@ -362,12 +364,11 @@ os_error *xfont_scan_string (font_f font, char const *s,
 		return &bad_parameters;
 	if ((flags & font_RETURN_BBOX) && !(flags & font_GIVEN_BLOCK))
 		return &bad_parameters;
-	if ((flags & font_GIVEN_BLOCK) && (block->space.x != 0 ||
-			block->space.y != 0 ||
-			block->letter.x != 0 ||
-			block->letter.y != 0 ||
-			block->split_char != -1))
+	if ((flags & font_GIVEN_BLOCK) && (block->space.y != 0 ||
+			block->letter.y != 0))
 		return &unimplemented;
+	if (flags & font_GIVEN_BLOCK)
+		split_char = block->split_char;
 
 	if ((flags & font_GIVEN32_BIT) && (flags & font_GIVEN16_BIT))
 		return &bad_parameters;
@@ -384,9 +385,18 @@ os_error *xfont_scan_string (font_f font, char const *s,
 	while (length > 0) {
 		uint32_t c = 0, i;
 		int cwidth;
+		bool space;
 		for (i = 0; i < advance; i++) {
 			c |= s[i] << (advance - i - 1);
 		}
+		space = s[0] == ' ';
+		for (i = 1; i < advance; i++)
+			space = space && s[i] == 0;
+		if (space && split_char == ' ') {
+			/* Split before the last split character reached */
+			split = s;
+			split_width = width;
+		}
 		s += advance;
 		length -= advance;
 
@@ -396,6 +406,10 @@ os_error *xfont_scan_string (font_f font, char const *s,
 
 		/* Just scale font size to millipoints and add on the width */
 		cwidth = ((h->fonts[font].xsize * 1000) >> 4);
+		if ((flags & font_GIVEN_TRFM) && trfm != NULL)
+			cwidth = ((int64_t) cwidth * trfm->entries[0][0]) >> 16;
+		if (flags & font_GIVEN_BLOCK)
+			cwidth += block->letter.x + (space ? block->space.x : 0);
 		if ((flags & font_RETURN_CARET_POS) && x > 0 &&
 				(width + cwidth/2) > x) {
 			/* Split point is less than half way through
@@ -406,8 +420,18 @@ os_error *xfont_scan_string (font_f font, char const *s,
 		}
 		width += cwidth;
 		//XXX: how is negative x meant to work?
-		if (x > 0 && width > x)
+		if (x > 0 && width > x) {
+			if (split != NULL) {
+				s = split;
+				width = split_width;
+			} else if (split_char != -1) {
+				/* No split character: split before the
+				 * character which did not fit */
+				s -= advance;
+				width -= cwidth;
+			}
 			break;
+		}
 	}
 
 	if (flags & font_RETURN_BBOX) {
@@ -425,7 +449,6 @@ os_error *xfont_scan_string (font_f font, char const *s,
 		*split_point = (char *) s;
 
 	(void) y;
-	(void) trfm;
 	(void) num_split_chars;
 
 	return NULL;
@@ -231,6 +231,24 @@ static void read_config(const char *path, struct cfg *cfg)
 	cfg->datadir = NULL;
 }
 
+static rufl_font_id callback_id;
+
+static void callback(void *context,
+		rufl_font_id font_id, unsigned int font_size,
+		const uint8_t *s8, const uint32_t *s32, unsigned int n,
+		int x, int y)
+{
+	(void) context;
+	(void) font_size;
+	(void) s8;
+	(void) s32;
+	(void) n;
+	(void) x;
+	(void) y;
+
+	callback_id = font_id;
+}
+
 int main(int argc, const char **argv)
 {
 	int width, x;
@@ -240,6 +258,8 @@ int main(int argc, const char **argv)
 	int8_t uline_position;
 	uint8_t uline_thickness;
 	os_box bbox;
+	const struct rufl_sized_font pinned = {
+			"Trinity", rufl_WEIGHT_500, 160 };
 
 	assert(2 == argc);
 
@@ -312,6 +332,14 @@ int main(int argc, const char **argv)
 			"\xf0\xa0\x80\xa5", 4, &width));
 	assert(26 == width);
 
+	/* Letter spacing is added to every character */
+	assert(rufl_OK == rufl_width_spaced("Corpus", rufl_WEIGHT_500, 160,
+			"!\xc2\xa0", 3, 5, 0, &width));
+	assert(60 == width);
+	assert(rufl_OK == rufl_width_spaced("Corpus", rufl_WEIGHT_500, 160,
+			"\xef\xbf\xbd", 3, 5, 10, &width));
+	assert(22 == width);
+
 	/* Measure font bounding box */
 	assert(rufl_OK == rufl_font_bbox("Corpus", rufl_WEIGHT_500, 160,
 			&bbox));
@@ -324,6 +352,18 @@ int main(int argc, const char **argv)
 	assert(rufl_OK == rufl_paint("Trinity", rufl_WEIGHT_500, 160,
 			"!\xc2\xa0", 3, 0, 0, 0));
 
+	/* Render via callback, identifying fonts by id */
+	callback_id = (rufl_font_id) -2;
+	assert(rufl_OK == rufl_paint_callback_id("Trinity", rufl_WEIGHT_500,
+			160, "!", 1, 0, 0, callback, NULL));
+	assert(NULL != rufl_font_id_name(callback_id));
+
+	/* Pin the handles for every encoding of a font, and render */
+	assert(rufl_OK == rufl_font_pin(&pinned, 1));
+	assert(rufl_OK == rufl_paint("Trinity", rufl_WEIGHT_500, 160,
+			"!\xc2\xa0", 3, 0, 0, 0));
+	rufl_font_unpin(&pinned, 1);
+
 	rufl_dump_state(true);
 
 	/* Obtain metrics for a glyph */
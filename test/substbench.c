@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "rufl_internal.h"
+
+#include "testutils.h"
+
+#define FONTS 64
+#define BLOCKS 16
+#define TEXT_SIZE 65536
+#define RUN_LENGTH 40
+
+static struct rufl_font_list_entry fonts[FONTS];
+static struct rufl_character_set charsets[FONTS];
+static char identifiers[FONTS][16];
+static uint32_t text[TEXT_SIZE];
+
+static uint32_t seed = 1;
+
+static uint32_t random_number(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+/* Give each font a random selection of blocks, each with a random share
+ * of its characters, so that coverage overlaps as in a real install. The
+ * last block of the plane is covered too, and completely by the last
+ * font. */
+static void generate_fonts(void)
+{
+	unsigned int f, b, u, used, density;
+
+	for (f = 0; f != FONTS; f++) {
+		snprintf(identifiers[f], sizeof identifiers[f], "Font%02u", f);
+		fonts[f].identifier = identifiers[f];
+		fonts[f].charset = &charsets[f];
+		charsets[f].metadata = sizeof charsets[f];
+		memset(charsets[f].index, BLOCK_EMPTY,
+				sizeof charsets[f].index);
+
+		used = 0;
+		for (b = 0; b != 256; b++) {
+			if (BLOCKS <= b && b != 255)
+				continue;
+			if (b == 255 && f == FONTS - 1) {
+				charsets[f].index[b] = BLOCK_FULL;
+				continue;
+			}
+			if (random_number() % 4 != 0)
+				continue;
+			if (random_number() % 8 == 0) {
+				charsets[f].index[b] = BLOCK_FULL;
+				continue;
+			}
+			density = 32 + random_number() % 224;
+			charsets[f].index[b] = used;
+			for (u = 0; u != 256; u++)
+				if (random_number() % 256 < density)
+					charsets[f].block[used][u >> 3] |=
+							1 << (u & 7);
+			used++;
+		}
+	}
+
+	rufl_font_list = fonts;
+	rufl_font_list_entries = FONTS;
+}
+
+/* Fill the text with runs of characters from a single block, as text in
+ * one script would be */
+static void generate_text(void)
+{
+	unsigned int i, block = 0;
+
+	for (i = 0; i != TEXT_SIZE; i++) {
+		if (i % RUN_LENGTH == 0)
+			block = random_number() % BLOCKS;
+		text[i] = (block << 8) | (random_number() % 256);
+	}
+}
+
+/* Count the spans the text would be processed in, and check that each
+ * character is given a font which has it */
+static unsigned int count_spans(void)
+{
+	unsigned int i, font, prev = NOT_AVAILABLE, spans = 0;
+
+	for (i = 0; i != TEXT_SIZE; i++) {
+		font = rufl_substitution_table_lookup(text[i]);
+		if (font != NOT_AVAILABLE)
+			assert(rufl_character_set_test(&charsets[font],
+					text[i]));
+		if (i == 0 || font != prev)
+			spans++;
+		prev = font;
+	}
+
+	return spans;
+}
+
+/* Fill the map for a block one bit at a time, as the substitution table
+ * did before it consumed character sets a word at a time */
+static void reference_fill_map(uint32_t block, uint16_t map[256])
+{
+	unsigned int f, u;
+
+	for (u = 0; u != 256; u++)
+		map[u] = NOT_AVAILABLE;
+
+	for (f = 0; f != FONTS; f++) {
+		if (charsets[f].index[block] == BLOCK_FULL) {
+			for (u = 0; u != 256; u++)
+				if (map[u] == NOT_AVAILABLE)
+					map[u] = f;
+		} else if (charsets[f].index[block] != BLOCK_EMPTY) {
+			const uint8_t *blk = charsets[f].block[
+					charsets[f].index[block]];
+			for (u = 0; u != 256; u++)
+				if (map[u] == NOT_AVAILABLE &&
+						(blk[u >> 3] & (1 << (u & 7))))
+					map[u] = f;
+		}
+	}
+}
+
+/* Check that the first-font table matches the per-bit fill for every
+ * block of the plane */
+static void check_first_font(void)
+{
+	uint16_t map[256];
+	uint32_t block, u;
+
+	for (block = 0; block != 256; block++) {
+		reference_fill_map(block, map);
+		for (u = 0; u != 256; u++)
+			assert(map[u] == rufl_substitution_table_lookup(
+					(block << 8) | u));
+	}
+}
+
+/* Check that each range found by rufl_substitution_table_lookup_run() is
+ * within a block and has the same font throughout */
+static void check_runs(void)
+{
+	uint32_t u, v, run_end;
+	unsigned int font;
+
+	for (u = 0; u != 0x10000; u++) {
+		assert(rufl_OK == rufl_substitution_table_lookup_run(u, &font,
+				&run_end));
+		assert(u <= run_end && (run_end >> 8) == (u >> 8));
+		for (v = u; v <= run_end; v++)
+			assert(font == rufl_substitution_table_lookup(v));
+	}
+}
+
+/* Count the characters which no font has */
+static unsigned int count_not_available(void)
+{
+	unsigned int u, count = 0;
+
+	for (u = 0; u != 0x10000; u++)
+		if (rufl_substitution_table_lookup(u) == NOT_AVAILABLE)
+			count++;
+
+	return count;
+}
+
+int main(int argc, const char **argv)
+{
+	static const char *policies[] = { "first-font", "locality" };
+	unsigned int policy, spans, not_available[2];
+	clock_t start;
+	double init;
+
+	UNUSED(argc);
+	UNUSED(argv);
+
+	generate_fonts();
+	generate_text();
+
+	for (policy = 0; policy != 2; policy++) {
+		rufl_set_substitution_policy(policy == 0 ?
+				rufl_SUBSTITUTION_FIRST_FONT :
+				rufl_SUBSTITUTION_LOCALITY);
+
+		start = clock();
+		assert(rufl_OK == rufl_substitution_table_init());
+		init = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+		if (policy == 0)
+			check_first_font();
+		check_runs();
+		spans = count_spans();
+		not_available[policy] = count_not_available();
+		printf("%-10s %6u spans, init %6.3f s\n", policies[policy],
+				spans, init);
+
+		rufl_substitution_table_fini();
+	}
+
+	/* the policy only changes which font is chosen */
+	assert(not_available[0] == not_available[1]);
+
+	printf("PASS\n");
+
+	return 0;
+}
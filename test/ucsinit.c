@@ -1,7 +1,10 @@
 #include <ftw.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
+#include <oslib/font.h>
+
 #include "rufl.h"
 
 #include "harness.h"
@@ -22,6 +25,45 @@ static int ftw_cb(const char *path, const struct stat *sb,
 	return 0;
 }
 
+static char callback_name[3][80];
+static rufl_font_id callback_id[3];
+static unsigned int callback_count;
+
+static void callback(void *context,
+		const char *font_name, unsigned int font_size,
+		const uint8_t *s8, const uint32_t *s32, unsigned int n,
+		int x, int y)
+{
+	(void) context;
+	(void) font_size;
+	(void) s8;
+	(void) s32;
+	(void) n;
+	(void) x;
+	(void) y;
+
+	assert(callback_count < 3);
+	snprintf(callback_name[callback_count++], sizeof callback_name[0],
+			"%s", font_name);
+}
+
+static void callback_id_fn(void *context,
+		rufl_font_id font_id, unsigned int font_size,
+		const uint8_t *s8, const uint32_t *s32, unsigned int n,
+		int x, int y)
+{
+	(void) context;
+	(void) font_size;
+	(void) s8;
+	(void) s32;
+	(void) n;
+	(void) x;
+	(void) y;
+
+	assert(callback_count < 3);
+	callback_id[callback_count++] = font_id;
+}
+
 static void cleanup(void)
 {
 	if (ptmp == NULL)
@@ -34,11 +76,26 @@ int main(int argc, const char **argv)
 {
 	int width, x;
 	size_t offset;
+	rufl_layout *layout;
+	rufl_face *face;
+	char long_string[1000];
+	const int line_widths[] = { 130, 60 };
+	struct rufl_line lines[4];
+	size_t line_count;
 	int32_t xkern, ykern, italic, ascent, descent, xheight, cap_height;
 	int32_t x_bearing, y_bearing, mwidth, mheight, x_advance, y_advance;
 	int8_t uline_position;
 	uint8_t uline_thickness;
 	os_box bbox;
+	struct rufl_stats stats;
+	font_f claimed[256];
+	const char *const families[] = { "Nonexistent", "Trinity", "Homerton" };
+	const struct rufl_sized_font pinned = {
+			"Trinity", rufl_WEIGHT_500, 160 };
+	const struct rufl_sized_font prefetched = {
+			"Homerton", rufl_WEIGHT_500, 320 };
+	const struct rufl_sized_font pinned_shared = {
+			"Trinity", rufl_WEIGHT_500, 480 };
 
 	UNUSED(argc);
 	UNUSED(argv);
@@ -50,6 +107,8 @@ int main(int argc, const char **argv)
 
 	rufl_test_harness_init(380, true, true);
 
+	assert(rufl_OK == rufl_set_family_alias("sans-serif", "Homerton"));
+
 	assert(rufl_OK == rufl_init());
 	assert(NULL == rufl_fm_error);
 	assert(3 == rufl_family_list_entries);
@@ -77,6 +136,11 @@ int main(int argc, const char **argv)
 			"!\xc2\xa0", 3, &width));
 	assert(50 == width);
 
+	/* Measure again, now the glyph advances are cached */
+	assert(rufl_OK == rufl_width("Corpus", rufl_WEIGHT_500, 160,
+			"!\xc2\xa0", 3, &width));
+	assert(50 == width);
+
 	/* Place caret after first character */
 	assert(rufl_OK == rufl_x_to_offset("Homerton", rufl_WEIGHT_500, 160,
 			"!\xc2\xa0", 3, 25, &offset, &x));
@@ -91,6 +155,119 @@ int main(int argc, const char **argv)
 	assert(3 == offset);
 	assert(50 == x);
 
+	/* Lay out once, then measure and hit-test repeatedly */
+	assert(rufl_OK == rufl_layout_create("Trinity", rufl_WEIGHT_500, 160,
+			"!\xc2\xa0\x01!", 5, &layout));
+	assert(rufl_OK == rufl_width("Trinity", rufl_WEIGHT_500, 160,
+			"!\xc2\xa0\x01!", 5, &width));
+	assert(rufl_OK == rufl_layout_width(layout, &x));
+	assert(width == x);
+	assert(rufl_OK == rufl_layout_x_to_offset(layout, 25, &offset, &x));
+	assert(1 == offset);
+	assert(25 == x);
+	assert(rufl_OK == rufl_layout_split(layout, 25, &offset, &x));
+	assert(3 == offset);
+	assert(50 == x);
+	assert(rufl_OK == rufl_layout_split(layout, width, &offset, &x));
+	assert(5 == offset);
+	assert(width == x);
+	assert(rufl_OK == rufl_layout_paint(layout, 0, 0, 0));
+	rufl_layout_destroy(layout);
+
+	/* Resolve a face once, then use it repeatedly */
+	assert(rufl_FONT_NOT_FOUND == rufl_face_resolve("Nonexistent",
+			rufl_WEIGHT_500, &face));
+	assert(rufl_FONT_NOT_FOUND == rufl_face_resolve("Trinit",
+			rufl_WEIGHT_500, &face));
+	/* Family names are matched ignoring case */
+	assert(rufl_OK == rufl_width("tRiNiTy", rufl_WEIGHT_500, 160,
+			"!\xc2\xa0\x01!", 5, &x));
+	assert(width == x);
+	assert(rufl_OK == rufl_width("tRiNiTy", rufl_WEIGHT_500, 160,
+			"!\xc2\xa0\x01!", 5, &x));
+	assert(width == x);
+	assert(rufl_OK == rufl_face_resolve("Trinity", rufl_WEIGHT_500, &face));
+	assert(rufl_OK == rufl_face_width(face, 160,
+			"!\xc2\xa0\x01!", 5, &x));
+	assert(width == x);
+	assert(rufl_OK == rufl_face_x_to_offset(face, 160,
+			"!\xc2\xa0", 3, 25, &offset, &x));
+	assert(1 == offset);
+	assert(25 == x);
+	assert(rufl_OK == rufl_face_split(face, 160,
+			"!\xc2\xa0", 3, 25, &offset, &x));
+	assert(3 == offset);
+	assert(50 == x);
+	assert(rufl_OK == rufl_face_paint(face, 160,
+			"!\xc2\xa0\x01!", 5, 0, 0, 0));
+	assert(rufl_OK == rufl_face_font_bbox(face, 160, &bbox));
+	assert(25 == bbox.x1);
+	assert(rufl_OK == rufl_face_glyph_metrics(face, 160, "!", 1,
+			&x_bearing, &y_bearing, &mwidth, &mheight,
+			&x_advance, &y_advance));
+	assert(10000 == x_advance);
+	rufl_face_destroy(face);
+
+	/* A long run in a single font is a single span */
+	memset(long_string, '0', sizeof long_string);
+	assert(rufl_OK == rufl_width("Homerton", rufl_WEIGHT_500, 160,
+			long_string, sizeof long_string, &width));
+	assert(25 * sizeof long_string == (size_t) width);
+	assert(rufl_OK == rufl_split("Homerton", rufl_WEIGHT_500, 160,
+			long_string, sizeof long_string, 25 * 450 + 10,
+			&offset, &x));
+	assert(451 == offset);
+	assert(25 * 451 == x);
+
+	/* Break a paragraph into lines, scanning each line once */
+	rufl_reset_stats();
+	assert(rufl_OK == rufl_break_lines("Homerton", rufl_WEIGHT_500, 160,
+			"00 00 00", 8, line_widths, 2, lines, 4, &line_count));
+	rufl_get_stats(&stats);
+	assert(2 == stats.spans);
+	assert(2 == line_count);
+	assert(6 == lines[0].offset);
+	assert(125 == lines[0].width);
+	assert(8 == lines[1].offset);
+	assert(50 == lines[1].width);
+	/* Trailing spaces are not part of a line's width */
+	assert(rufl_OK == rufl_break_lines("Homerton", rufl_WEIGHT_500, 160,
+			"00  00 00 ", 10, line_widths, 2, lines, 4,
+			&line_count));
+	assert(3 == line_count);
+	assert(4 == lines[0].offset);
+	assert(50 == lines[0].width);
+	assert(7 == lines[1].offset);
+	assert(50 == lines[1].width);
+	assert(10 == lines[2].offset);
+	assert(50 == lines[2].width);
+	/* A break may go back to a space in an earlier run */
+	assert(rufl_OK == rufl_break_lines("Homerton", rufl_WEIGHT_500, 160,
+			"00 \x01\x01\x01\x01", 7, line_widths, 2, lines, 4,
+			&line_count));
+	assert(2 == line_count);
+	assert(3 == lines[0].offset);
+	assert(50 == lines[0].width);
+	assert(7 == lines[1].offset);
+	assert(68 == lines[1].width);
+	/* A word which is too wide is placed on a line by itself */
+	assert(rufl_OK == rufl_break_lines("Homerton", rufl_WEIGHT_500, 160,
+			"0 0000 0", 8, line_widths + 1, 1, lines, 4,
+			&line_count));
+	assert(3 == line_count);
+	assert(2 == lines[0].offset);
+	assert(25 == lines[0].width);
+	assert(7 == lines[1].offset);
+	assert(100 == lines[1].width);
+	assert(8 == lines[2].offset);
+	assert(25 == lines[2].width);
+	/* Stop when out of lines */
+	assert(rufl_OK == rufl_break_lines("Homerton", rufl_WEIGHT_500, 160,
+			"0 0000 0", 8, line_widths + 1, 1, lines, 1,
+			&line_count));
+	assert(1 == line_count);
+	assert(2 == lines[0].offset);
+
 	/* Compute width of replacement character */
 	assert(rufl_OK == rufl_width("Corpus", rufl_WEIGHT_500, 160,
 			"\xef\xbf\xbd", 3, &width));
@@ -98,6 +275,31 @@ int main(int argc, const char **argv)
 	assert(rufl_OK == rufl_width("Corpus", rufl_WEIGHT_500, 160,
 			"\xf0\xa0\x80\xa5", 4, &width));
 	assert(26 == width);
+	/* The second character is in the range found for the first */
+	rufl_reset_stats();
+	assert(rufl_OK == rufl_width("Corpus", rufl_WEIGHT_500, 160,
+			"\xf0\xa0\x80\xa6\xf0\xa0\x80\xa7", 8, &width));
+	assert(52 == width);
+	rufl_get_stats(&stats);
+	assert(1 == stats.resolve_cache_misses);
+	assert(1 == stats.resolve_run_hits);
+	assert(rufl_OK == rufl_width("Corpus", rufl_WEIGHT_500, 160,
+			"\xf0\xa0\x80\xa6", 4, &width));
+	rufl_get_stats(&stats);
+	assert(1 == stats.resolve_cache_hits);
+	rufl_reset_stats();
+	assert(rufl_OK == rufl_width("Homerton", rufl_WEIGHT_500, 200,
+			"!!", 2, &width));
+	rufl_get_stats(&stats);
+	assert(1 == stats.advance_cache_misses);
+	assert(1 == stats.advance_cache_hits);
+	assert(rufl_OK == rufl_width("Corpus", rufl_WEIGHT_500, 160,
+			"\xf0\xa0\x80\xa6!\xf0\xa0\x80\xa7", 9, &width));
+	assert(77 == width);
+	/* Astral plane table is constructed by the first lookup */
+	assert(rufl_OK == rufl_width("Corpus", rufl_WEIGHT_500, 160,
+			"\xf0\x90\xab\x80", 4, &width));
+	assert(25 == width);
 
 	/* Measure font bounding box */
 	assert(rufl_OK == rufl_font_bbox("Corpus", rufl_WEIGHT_500, 160,
@@ -111,6 +313,27 @@ int main(int argc, const char **argv)
 	assert(rufl_OK == rufl_paint("Trinity", rufl_WEIGHT_500, 160,
 			"!\xc2\xa0", 3, 0, 0, 0));
 
+	/* Render characters which are not in any font */
+	assert(rufl_OK == rufl_paint("Trinity", rufl_WEIGHT_500, 160,
+			"\x01\x02\xf0\x9f\x98\x80", 6, 0, 0, 0));
+
+	/* Render via callbacks: a span, then the two rows of a hex box */
+	callback_count = 0;
+	assert(rufl_OK == rufl_paint_callback("Trinity", rufl_WEIGHT_500, 160,
+			"!\x01", 2, 0, 0, callback, NULL));
+	assert(3 == callback_count);
+	callback_count = 0;
+	assert(rufl_OK == rufl_paint_callback_id("Trinity", rufl_WEIGHT_500,
+			160, "!\x01", 2, 0, 0, callback_id_fn, NULL));
+	assert(3 == callback_count);
+	assert(0 == strcmp(callback_name[0],
+			rufl_font_id_name(callback_id[0])));
+	assert(0 == strcmp(callback_name[1],
+			rufl_font_id_name(callback_id[1])));
+	assert(callback_id[1] == callback_id[2]);
+	assert(rufl_font_id_name(callback_id[0]) ==
+			rufl_font_id_name(callback_id[0]));
+
 	/* Obtain metrics for a glyph */
 	assert(rufl_OK == rufl_glyph_metrics("Homerton", rufl_WEIGHT_500, 160,
 			"!", 1, &x_bearing, &y_bearing,
@@ -122,11 +345,182 @@ int main(int argc, const char **argv)
 	assert(10000 == x_advance);
 	assert(10000 == y_advance);
 
+	/* Cycle through more sizes than there are cached handles */
+	assert(rufl_OK == rufl_set_handle_cache_size(2));
+	for (x = 0; x != 6; x++) {
+		assert(rufl_OK == rufl_width("Homerton", rufl_WEIGHT_500,
+				160 * (1 + x % 3), "!", 1, &width));
+		assert(25 * (1 + x % 3) == width);
+	}
+	assert(rufl_OK == rufl_set_handle_cache_size(0));
+	assert(rufl_OK == rufl_set_handle_cache_size(1000));
+	for (x = 0; x != 40; x++) {
+		assert(rufl_OK == rufl_width("Trinity", rufl_WEIGHT_500,
+				32 * (1 + x % 20), "!", 1, &width));
+		assert(5 * (1 + x % 20) == width);
+	}
+
+	/* Count the work done by a paint */
+	rufl_reset_stats();
+	assert(rufl_OK == rufl_paint("Trinity", rufl_WEIGHT_500, 160,
+			"!\x01", 2, 0, 0, 0));
+	rufl_get_stats(&stats);
+	assert(2 == stats.spans);
+	assert(1 == stats.code_points_font);
+	assert(0 == stats.code_points_substituted);
+	assert(1 == stats.code_points_not_available);
+	assert(3 == stats.font_paint);
+	assert(0 != stats.handle_cache_hits + stats.handle_cache_misses);
+
+	/* A run of hex boxes is painted a row at a time, and the digits are
+	 * measured only once for each handle */
+	assert(rufl_OK == rufl_paint("Trinity", rufl_WEIGHT_500, 160,
+			"\x01\x02", 2, 0, 0, 0));
+	rufl_reset_stats();
+	assert(rufl_OK == rufl_paint("Trinity", rufl_WEIGHT_500, 160,
+			"\x01\x02", 2, 0, 0, 0));
+	assert(rufl_OK == rufl_paint("Trinity", rufl_WEIGHT_500, 160,
+			"\x01\x02\x03\x04\x05\x06\x07\x08"
+			"\x01\x02\x03\x04\x05\x06\x07\x08"
+			"\x01\x02\x03\x04", 20, 0, 0, 0));
+	rufl_get_stats(&stats);
+	assert(4 == stats.font_paint);
+	assert(0 == stats.font_scan_string);
+
+	/* Pinned handles stay open even if the cache is too small */
+	assert(rufl_OK == rufl_set_handle_cache_size(1));
+	assert(rufl_OK == rufl_font_pin(&pinned, 1));
+	rufl_reset_stats();
+	assert(rufl_OK == rufl_paint("Trinity", rufl_WEIGHT_500, 160,
+			"!\x01!\x01", 4, 0, 0, 0));
+	rufl_get_stats(&stats);
+	assert(0 == stats.font_find_font);
+	assert(0 == stats.handle_cache_evictions);
+	rufl_font_unpin(&pinned, 1);
+	assert(rufl_OK == rufl_set_handle_cache_size(10));
+
+	/* Prefetched handles are found in the cache */
+	assert(rufl_OK == rufl_font_prefetch(&prefetched, 1));
+	rufl_reset_stats();
+	assert(rufl_OK == rufl_paint("Homerton", rufl_WEIGHT_500, 320,
+			"!\x01", 2, 0, 0, 0));
+	rufl_get_stats(&stats);
+	assert(0 == stats.font_find_font);
+
+	/* Redirecting output to a printer keeps the screen's handles */
+	rufl_set_output_context(rufl_CONTEXT_PRINTER);
+	rufl_set_output_context_resolution(rufl_CONTEXT_PRINTER, 300, 300);
+	rufl_reset_stats();
+	assert(rufl_OK == rufl_paint("Homerton", rufl_WEIGHT_500, 320,
+			"!\x01", 2, 0, 0, 0));
+	rufl_get_stats(&stats);
+	assert(2 == stats.font_find_font);
+	rufl_set_output_context(rufl_CONTEXT_SCREEN);
+	rufl_reset_stats();
+	assert(rufl_OK == rufl_paint("Homerton", rufl_WEIGHT_500, 320,
+			"!\x01", 2, 0, 0, 0));
+	rufl_get_stats(&stats);
+	assert(0 == stats.font_find_font);
+
+	/* Other sizes share the handle for a reference size */
+	rufl_set_size_sharing(320, 100);
+	rufl_reset_stats();
+	assert(rufl_OK == rufl_width("Homerton", rufl_WEIGHT_500, 480,
+			"!!", 2, &width));
+	assert(150 == width);
+	assert(rufl_OK == rufl_width("Homerton", rufl_WEIGHT_500, 560,
+			"!!", 2, &width));
+	assert(175 == width);
+	assert(rufl_OK == rufl_paint("Homerton", rufl_WEIGHT_500, 560,
+			"!!", 2, 0, 0, 0));
+	rufl_get_stats(&stats);
+	assert(0 == stats.font_find_font);
+	assert(0 != stats.shared_size_lookups);
+
+	/* Pinning a shared size pins the reference size's handle */
+	assert(rufl_OK == rufl_set_handle_cache_size(1));
+	assert(rufl_OK == rufl_font_pin(&pinned_shared, 1));
+	assert(rufl_OK == rufl_paint("Homerton", rufl_WEIGHT_500, 160,
+			"!", 1, 0, 0, 0));
+	assert(rufl_OK == rufl_paint("Trinity", rufl_WEIGHT_500, 160,
+			"!", 1, 0, 0, 0));
+	rufl_reset_stats();
+	assert(rufl_OK == rufl_paint("Trinity", rufl_WEIGHT_500, 480,
+			"!", 1, 0, 0, 0));
+	rufl_get_stats(&stats);
+	assert(0 == stats.font_find_font);
+	assert(0 != stats.shared_size_lookups);
+	rufl_font_unpin(&pinned_shared, 1);
+	assert(rufl_OK == rufl_set_handle_cache_size(10));
+	rufl_set_size_sharing(0, 0);
+
+	/* Each character comes from the first family in a list with it */
+	assert(rufl_OK == rufl_width_families(families, 3, rufl_WEIGHT_500,
+			160, "!\xc2\xa0", 3, &width));
+	assert(50 == width);
+	assert(rufl_OK == rufl_split_families(families, 3, rufl_WEIGHT_500,
+			160, "!\xc2\xa0", 3, 25, &offset, &x));
+	assert(3 == offset);
+	assert(50 == x);
+	assert(rufl_OK == rufl_x_to_offset_families(families, 3,
+			rufl_WEIGHT_500, 160, "!\xc2\xa0", 3, 25, &offset, &x));
+	assert(1 == offset);
+	assert(25 == x);
+	assert(rufl_OK == rufl_paint_families(families, 3, rufl_WEIGHT_500,
+			160, "!\x01", 2, 0, 0, 0));
+	assert(rufl_FONT_NOT_FOUND == rufl_width_families(families, 1,
+			rufl_WEIGHT_500, 160, "!", 1, &width));
+
+	/* Spacing is added after letters, and again after spaces */
+	for (x = 0; x != 2; x++) {
+		assert(rufl_OK == rufl_width_spaced("Homerton",
+				rufl_WEIGHT_500, 160, "! !", 3, 5, 10, &width));
+		assert(100 == width);
+	}
+	assert(rufl_OK == rufl_x_to_offset_spaced("Homerton", rufl_WEIGHT_500,
+			160, "!!", 2, 5, 10, 40, &offset, &x));
+	assert(1 == offset);
+	assert(30 == x);
+	assert(rufl_OK == rufl_paint_spaced("Homerton", rufl_WEIGHT_500, 160,
+			"! !\x01", 4, 0, 0, 0, 5, 10));
+
+	/* Aliases are found like real families */
+	assert(rufl_OK == rufl_width("Sans-Serif", rufl_WEIGHT_500, 160,
+			"!", 1, &width));
+	assert(25 == width);
+	assert(rufl_OK == rufl_set_family_alias("serif", "trinity"));
+	assert(rufl_OK == rufl_set_family_alias("fantasy", "Nonexistent"));
+	assert(rufl_OK == rufl_width("serif", rufl_WEIGHT_500, 160,
+			"!", 1, &width));
+	assert(25 == width);
+	assert(rufl_FONT_NOT_FOUND == rufl_width("fantasy", rufl_WEIGHT_500,
+			160, "!", 1, &width));
+	assert(rufl_OK == rufl_set_family_alias("serif", 0));
+	assert(rufl_FONT_NOT_FOUND == rufl_width("serif", rufl_WEIGHT_500,
+			160, "!", 1, &width));
+	assert(rufl_OK == rufl_set_family_alias("fantasy", 0));
+	assert(rufl_OK == rufl_set_family_alias("sans-serif", 0));
+
+	/* Running out of font handles loses cached handles and retries */
+	for (x = 0; x != 256; x++)
+		if (xfont_find_font("Trinity.Medium\\EUTF8", 1000 + x,
+				1000 + x, 0, 0, &claimed[x], 0, 0))
+			break;
+	rufl_reset_stats();
+	assert(rufl_OK == rufl_width("Homerton", rufl_WEIGHT_500, 640,
+			"!", 1, &width));
+	assert(100 == width);
+	rufl_get_stats(&stats);
+	assert(0 != stats.handle_exhaustions);
+	while (x--)
+		assert(NULL == xfont_lose_font(claimed[x]));
+
 	rufl_dump_state(true);
 
 	rufl_quit();
 
 	/* Reinit -- should load cache */
+	rufl_set_substitution_policy(rufl_SUBSTITUTION_LOCALITY);
 	assert(rufl_OK == rufl_init());
 	assert(NULL == rufl_fm_error);
 	assert(3 == rufl_family_list_entries);
@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "rufl_internal.h"
+
+#include "testutils.h"
+
+#define BUFFER_SIZE 65536
+#define ITERATIONS 20
+
+static struct rufl_character_set charsets[4];
+static uint8_t buffer[BUFFER_SIZE];
+static uint32_t ref_u[BUFFER_SIZE + 1], fast_u[BUFFER_SIZE + 1];
+static size_t ref_offset[BUFFER_SIZE + 1], fast_offset[BUFFER_SIZE + 1];
+static bool ref_font[BUFFER_SIZE + 1], fast_font[BUFFER_SIZE + 1];
+
+static uint32_t seed = 1;
+
+static uint32_t random_number(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+static bool in_font(const struct rufl_character_set *charset, uint32_t u)
+{
+	if (u <= 0x001f || (0x007f <= u && u <= 0x009f))
+		return false;
+	return charset && rufl_character_set_test(charset, u);
+}
+
+/* Decode and classify one character at a time, as rufl_process used to */
+static size_t decode_reference(const struct rufl_character_set *charset,
+		const uint8_t *s, size_t l)
+{
+	const uint8_t *s0 = s;
+	unsigned int u;
+	size_t n = 0;
+
+	while (l != 0) {
+		ref_offset[n] = s - s0;
+		rufl_utf8_read(s, l, u);
+		ref_u[n] = u;
+		ref_font[n++] = in_font(charset, u);
+	}
+	ref_offset[n] = s - s0;
+
+	return n;
+}
+
+/* Decode and classify runs of printable ASCII in bulk */
+static size_t decode_fast(const struct rufl_character_set *charset,
+		const uint8_t *s, size_t l)
+{
+	const uint8_t *s0 = s;
+	struct rufl_ascii_set ascii;
+	unsigned int u;
+	size_t n = 0;
+	size_t i, k;
+
+	rufl_character_set_ascii(charset, &ascii);
+
+	while (l != 0) {
+		k = rufl_utf8_ascii_span(&ascii, s, l);
+		for (i = 0; i != k; i++) {
+			fast_offset[n] = s - s0 + i;
+			fast_u[n] = s[i];
+			fast_font[n++] = true;
+		}
+		s += k;
+		l -= k;
+		if (l == 0)
+			break;
+
+		/* the span must not stop early */
+		if (s[0] < 0x80 && in_font(charset, s[0]))
+			return (size_t) -1;
+
+		fast_offset[n] = s - s0;
+		rufl_utf8_read(s, l, u);
+		fast_u[n] = u;
+		fast_font[n++] = in_font(charset, u);
+	}
+	fast_offset[n] = s - s0;
+
+	return n;
+}
+
+static void compare(const struct rufl_character_set *charset,
+		const uint8_t *s, size_t l)
+{
+	size_t n;
+
+	n = decode_reference(charset, s, l);
+	assert(n == decode_fast(charset, s, l));
+	assert(0 == memcmp(ref_u, fast_u, n * sizeof ref_u[0]));
+	assert(0 == memcmp(ref_offset, fast_offset,
+			(n + 1) * sizeof ref_offset[0]));
+	assert(0 == memcmp(ref_font, fast_font, n * sizeof ref_font[0]));
+}
+
+/* Fill the buffer with text of the given kind */
+static void generate(unsigned int kind)
+{
+	static const uint8_t fragments[][4] = {
+		{ 0xc3, 0xa9 }, { 0xc2, 0xa0 }, { 0xc0, 0x80 },
+		{ 0xe2, 0x82, 0xac }, { 0xed, 0xa0, 0x80 }, { 0xef, 0xbf, 0xbe },
+		{ 0xe0, 0x80, 0xaf }, { 0xf0, 0x9f, 0x98, 0x80 },
+		{ 0xf0, 0x8f, 0xbf, 0xbf }, { 0x80 }, { 0xff }, { 0xe2, 0x82 }
+	};
+	size_t i = 0, j;
+	uint32_t r;
+
+	while (i != BUFFER_SIZE) {
+		r = random_number();
+		if (kind == 0 || (r & 0xff) < 240) {
+			/* printable ASCII, with the odd line break */
+			buffer[i++] = (r >> 8) % 97 == 0 ? '\n' :
+					0x20 + (r >> 8) % 0x5f;
+		} else if (kind == 1) {
+			/* Latin-1 */
+			buffer[i++] = 0xc3;
+			if (i != BUFFER_SIZE)
+				buffer[i++] = 0x80 + (r >> 8) % 0x40;
+		} else if (kind == 2) {
+			/* anything at all */
+			buffer[i++] = r >> 8;
+		} else {
+			/* valid, invalid and truncated sequences */
+			r = (r >> 8) % (sizeof fragments / sizeof fragments[0]);
+			for (j = 0; j != 4 && fragments[r][j] &&
+					i != BUFFER_SIZE; j++)
+				buffer[i++] = fragments[r][j];
+		}
+	}
+}
+
+static double benchmark(size_t (*decode)(const struct rufl_character_set *,
+		const uint8_t *, size_t),
+		const struct rufl_character_set *charset)
+{
+	clock_t start = clock();
+	unsigned int i;
+
+	for (i = 0; i != ITERATIONS; i++)
+		decode(charset, buffer, BUFFER_SIZE);
+
+	return (double) (clock() - start) / CLOCKS_PER_SEC;
+}
+
+int main(int argc, const char **argv)
+{
+	static const char *kinds[] = { "ascii", "latin-1", "random", "mixed" };
+	const struct rufl_character_set *charset;
+	unsigned int kind, c, i;
+	size_t start, l;
+	double ref, fast;
+
+	UNUSED(argc);
+	UNUSED(argv);
+
+	/* 0: all of U+0020 to U+00FF; 1: letters and space only;
+	 * 2: block 0 full; 3: nothing in the BMP */
+	for (c = 0; c != 4; c++) {
+		charsets[c].metadata = sizeof charsets[c];
+		memset(charsets[c].index, BLOCK_EMPTY,
+				sizeof charsets[c].index);
+	}
+	charsets[0].index[0] = 0;
+	for (i = 0x20; i != 0x100; i++)
+		charsets[0].block[0][i >> 3] |= 1 << (i & 7);
+	charsets[1].index[0] = 0;
+	charsets[1].block[0][0x20 >> 3] |= 1 << (0x20 & 7);
+	for (i = 0; i != 26; i++) {
+		charsets[1].block[0][('a' + i) >> 3] |= 1 << (('a' + i) & 7);
+		charsets[1].block[0][('A' + i) >> 3] |= 1 << (('A' + i) & 7);
+	}
+	charsets[2].index[0] = BLOCK_FULL;
+
+	for (kind = 0; kind != 4; kind++) {
+		generate(kind);
+
+		for (c = 0; c != 5; c++) {
+			charset = c == 4 ? NULL : &charsets[c];
+
+			/* all short strings at every alignment */
+			for (start = 0; start != 64; start++)
+				for (l = 0; l != 64; l++)
+					compare(charset, buffer + start, l);
+
+			compare(charset, buffer, BUFFER_SIZE);
+		}
+
+		ref = benchmark(decode_reference, &charsets[0]);
+		fast = benchmark(decode_fast, &charsets[0]);
+		printf("%-8s reference %6.1f MB/s, fast %6.1f MB/s\n",
+				kinds[kind],
+				ref ? ITERATIONS * BUFFER_SIZE / ref / 1e6 : 0,
+				fast ? ITERATIONS * BUFFER_SIZE / fast / 1e6 : 0);
+	}
+
+	printf("PASS\n");
+
+	return 0;
+}